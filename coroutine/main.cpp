@@ -1,11 +1,11 @@
-#include <coroutine>
-#include <iostream>
-
+#include <chrono>
 #include <coroutine>
 #include <iostream>
 #include <stdexcept>
 #include <thread>
- 
+
+#include "Task.h"
+
 auto switch_to_new_thread(std::jthread& out)
 {
     struct awaitable
@@ -26,20 +26,8 @@ auto switch_to_new_thread(std::jthread& out)
     };
     return awaitable{&out};
 }
- 
-struct task
-{
-    struct promise_type
-    {
-        task get_return_object() { return {}; }
-        std::suspend_never initial_suspend() { return {}; }
-        std::suspend_never final_suspend() noexcept { return {}; }
-        void return_void() {}
-        void unhandled_exception() {}
-    };
-};
- 
-task resuming_on_new_thread(std::jthread& out)
+
+Task<void> resuming_on_new_thread(std::jthread& out)
 {
     std::cout << "Coroutine started on thread: " << std::this_thread::get_id() << '\n';
     co_await switch_to_new_thread(out);
@@ -47,57 +35,61 @@ task resuming_on_new_thread(std::jthread& out)
     std::cout << "Coroutine resumed on thread: " << std::this_thread::get_id() << '\n';
 }
 
+// Task is lazy, nothing runs until it is awaited
+Task<int> answer()
+{
+    co_return 42;
+}
 
+Task<int> fail()
+{
+    throw std::runtime_error("failed inside the coroutine");
+    co_return 0;
+}
 
-struct Task_promise_type;
-
-// 自定義 coroutine 類別
-class Task : public std::coroutine_handle<Task_promise_type> {
-public:
-    using promise_type = Task_promise_type;
-};
-
-struct Task_promise_type {
-    // 取得 coroutine handle 的返回對象
-    Task get_return_object() {
-        return { Task::from_promise(*this) };
-    }
-    std::suspend_never initial_suspend() noexcept { return {}; }
-    std::suspend_always final_suspend() noexcept { return {}; }
-    void return_void() {}
-    void unhandled_exception() {}
-};
-
-Task coroutine_example()
+// every level awaits the next, a finished level transfers straight back to
+// its awaiter. optimized, the transfer is a tail call and the depth doesn't
+// grow the stack, gcc only makes it one from -O2 though.
+Task<long> depth(long n)
 {
-    std::cout << "Coroutine started\n";
-    co_await std::suspend_always{};  // 讓 coroutine 掛起
-    std::cout << "Coroutine resumed\n";
-    co_return;
+    if (n == 0)
+        co_return 0;
+    co_return co_await depth(n - 1) + 1;
 }
 
-int main() {
+Task<long> add(long a, long b)
+{
+    co_return a + b;
+}
 
+Task<void> examples()
+{
+    std::cout << "Answer: " << co_await answer() << '\n';
 
-    // 啟動 coroutine 並取得 handle
-    auto handle = coroutine_example();
-    
-    std::cout << "Coroutine is now suspended\n";
+    try {
+        co_await fail();
+    } catch (const std::exception& e) {
+        std::cout << "Caught: " << e.what() << '\n';
+    }
 
-    // 在 main 中控制 coroutine 的恢復
-    std::cout << "Resuming coroutine...\n";
-    handle.resume();  // 恢復 coroutine
+    std::cout << "Depth: " << co_await depth(1'000) << '\n';
+}
 
-    // 檢查 coroutine 是否完成
-    if (handle.done()) {
-        std::cout << "Coroutine has finished\n";
-    }
+int main() {
+    spawn(examples()).get();
 
-    // 清理 handle
-    handle.destroy();
+    // short lived coroutines, their frames and futures come from the per
+    // thread caches instead of the global allocator
+    constexpr long count = 1'000'000;
+    long total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < count; ++i)
+        total = spawn(add(total, i)).get();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Sum: " << total << ", " << count / elapsed.count() / 1e6 << " M coroutines/s\n";
 
     std::jthread out;
-    auto thread_task = resuming_on_new_thread(out);
+    spawn(resuming_on_new_thread(out)).get();
 
     return 0;
 }
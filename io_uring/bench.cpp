@@ -0,0 +1,229 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "file_reader.h"
+
+// reads the same files with a pread loop, with pread on a ThreadPool and
+// with file_reader in each of its ring modes, and prints one JSON object per
+// configuration with the best GB/s out of --repeat runs
+
+struct settings {
+    std::vector<std::string> paths;
+    std::size_t block_size = 1024 * 128;
+    unsigned queue_depth = 128;
+    // completions per wait in the batched configurations
+    unsigned batch = 16;
+    // where the poller of the sqpoll configuration runs, anywhere if negative
+    int sqpoll_cpu = -1;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t repeat = 3;
+    bool direct = false;
+    std::string config;
+};
+
+// one block of one file, the unit of work of the pread configurations
+struct block {
+    int fd;
+    std::uint64_t offset;
+};
+
+struct opened_files {
+    std::vector<unique_fd> files;
+    std::vector<block> blocks;
+};
+
+static bool open_files(const settings& the_settings, opened_files& opened)
+{
+    for (const std::string& path : the_settings.paths) {
+        unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC | (the_settings.direct ? O_DIRECT : 0)));
+        struct stat status;
+        if (!fd || fstat(fd, &status) == -1) {
+            perror(path.c_str());
+            return false;
+        }
+
+        for (std::uint64_t offset = 0; offset < static_cast<std::uint64_t>(status.st_size); offset += the_settings.block_size)
+            opened.blocks.push_back({ fd, offset });
+        opened.files.push_back(std::move(fd));
+    }
+    return true;
+}
+
+using buffer_ptr = std::unique_ptr<std::byte[], decltype(&free)>;
+
+static buffer_ptr make_buffer(std::size_t size)
+{
+    size = (size + file_reader::alignment - 1) / file_reader::alignment * file_reader::alignment;
+    return buffer_ptr(static_cast<std::byte*>(std::aligned_alloc(file_reader::alignment, size)), &free);
+}
+
+// whole blocks, short at the end of a file, -1 on an error
+static std::uint64_t read_block(const block& the_block, std::byte* buffer, std::size_t size)
+{
+    std::uint64_t total = 0;
+    while (total < size) {
+        ssize_t ret = pread(the_block.fd, buffer, size - total, the_block.offset + total);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return ret < 0 ? static_cast<std::uint64_t>(-1) : total;
+        total += ret;
+    }
+    return total;
+}
+
+static std::uint64_t pread_loop(const settings& the_settings, const opened_files& opened)
+{
+    buffer_ptr buffer = make_buffer(the_settings.block_size);
+    std::uint64_t total = 0;
+    for (const block& the_block : opened.blocks) {
+        std::uint64_t size = read_block(the_block, buffer.get(), the_settings.block_size);
+        if (size == static_cast<std::uint64_t>(-1))
+            return 0;
+        total += size;
+    }
+    return total;
+}
+
+static std::uint64_t pread_pool(const settings& the_settings, const opened_files& opened, ThreadPool& pool)
+{
+    std::atomic<std::uint64_t> total{0};
+    std::atomic<bool> failed{false};
+    pool.parallel_for(std::size_t(0), opened.blocks.size(), [&](std::size_t index) {
+        thread_local buffer_ptr buffer = make_buffer(the_settings.block_size);
+        std::uint64_t size = read_block(opened.blocks[index], buffer.get(), the_settings.block_size);
+        if (size == static_cast<std::uint64_t>(-1))
+            failed.store(true, std::memory_order_relaxed);
+        else
+            total.fetch_add(size, std::memory_order_relaxed);
+    });
+    return failed ? 0 : total.load();
+}
+
+static std::uint64_t uring_read(const settings& the_settings, file_reader& reader)
+{
+    auto total = reader.read(the_settings.paths, [](unsigned, std::uint64_t, std::span<const std::byte>) {});
+    if (!total) {
+        fprintf(stderr, "file_reader: %s\n", total.error().message().c_str());
+        return 0;
+    }
+    return *total;
+}
+
+// one untimed run to warm up, then the best of the_settings.repeat
+static void run(const settings& the_settings, const std::string& config, const std::function<std::uint64_t()>& body)
+{
+    if (!the_settings.config.empty() && the_settings.config != config)
+        return;
+
+    body();
+
+    std::uint64_t bytes = 0;
+    double best = 0;
+    for (size_t r = 0; r < the_settings.repeat; ++r) {
+        const auto start = std::chrono::steady_clock::now();
+        bytes = body();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (r == 0 || seconds < best)
+            best = seconds;
+    }
+
+    printf("{\"config\":\"%s\",\"files\":%zu,\"block_size\":%zu,\"queue_depth\":%u,\"threads\":%zu,\"direct\":%s"
+           ",\"bytes\":%llu,\"seconds\":%.6f,\"gb_per_sec\":%.3f}\n",
+           config.c_str(), the_settings.paths.size(), the_settings.block_size, the_settings.queue_depth,
+           the_settings.threads, the_settings.direct ? "true" : "false", static_cast<unsigned long long>(bytes),
+           best, best > 0 ? bytes / best / 1e9 : 0.0);
+    fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--block-size BYTES] [--queue-depth N] [--batch N] [--sqpoll-cpu N] [--threads N] [--repeat N]"
+                    " [--direct] [--config pread|pread_pool|io_uring|io_uring_no_fixed|io_uring_batch|io_uring_sqpoll"
+                    "|io_uring_defer_taskrun] <file>...\n"
+                    "Prints one JSON object per configuration.\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    settings the_settings;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--direct")
+            the_settings.direct = true;
+        else if (arg == "--block-size" && i + 1 < argc)
+            the_settings.block_size = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--queue-depth" && i + 1 < argc)
+            the_settings.queue_depth = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--batch" && i + 1 < argc)
+            the_settings.batch = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--sqpoll-cpu" && i + 1 < argc)
+            the_settings.sqpoll_cpu = strtol(argv[++i], nullptr, 10);
+        else if (arg == "--threads" && i + 1 < argc)
+            the_settings.threads = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--repeat" && i + 1 < argc)
+            the_settings.repeat = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--config" && i + 1 < argc)
+            the_settings.config = argv[++i];
+        else if (arg.starts_with("--")) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        else
+            the_settings.paths.emplace_back(arg);
+    }
+
+    opened_files opened;
+    if (the_settings.paths.empty() || !open_files(the_settings, opened)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    run(the_settings, "pread", [&] { return pread_loop(the_settings, opened); });
+
+    {
+        ThreadPool pool(the_settings.threads);
+        run(the_settings, "pread_pool", [&] { return pread_pool(the_settings, opened, pool); });
+    }
+
+    // one wait per completion, then the batched waits alone, with the
+    // poller submitting, and with completion work deferred to the waits
+    const file_reader_options base = { .queue_depth = the_settings.queue_depth, .block_size = the_settings.block_size,
+                                       .direct = the_settings.direct };
+    std::vector<std::pair<std::string, file_reader_options>> readers = {
+        { "io_uring", base }, { "io_uring_no_fixed", base }, { "io_uring_batch", base },
+        { "io_uring_sqpoll", base }, { "io_uring_defer_taskrun", base },
+    };
+    readers[1].second.fixed = false;
+    for (std::size_t index = 2; index < readers.size(); ++index)
+        readers[index].second.batch = std::min(the_settings.batch, the_settings.queue_depth);
+    readers[3].second.ring = { .sqpoll = true, .sqpoll_cpu = the_settings.sqpoll_cpu };
+    readers[4].second.ring = { .coop_taskrun = true, .single_issuer = true, .defer_taskrun = true };
+
+    for (const auto& [config, options] : readers) {
+        if (!the_settings.config.empty() && the_settings.config != config)
+            continue;
+
+        auto reader = file_reader::create(options);
+        if (!reader) {
+            fprintf(stderr, "%s: %s\n", config.c_str(), reader.error().message().c_str());
+            continue;
+        }
+        run(the_settings, config, [&] { return uring_read(the_settings, *reader); });
+    }
+
+    return EXIT_SUCCESS;
+}
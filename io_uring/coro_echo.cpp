@@ -0,0 +1,170 @@
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <stop_token>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ring_context.h"
+
+// the echo protocol of socket_server written straight down with
+// ring_context, one coroutine per connection and one accepting, on as many
+// reactor threads with their own ring and SO_REUSEPORT listener
+
+struct server_options {
+    const char* hostname = "localhost";
+    const char* port = "8080";
+    unsigned reactors = std::max(1u, std::thread::hardware_concurrency());
+    int backlog = 128;
+    unsigned entries = 256;
+    ring_options ring;
+};
+
+static unique_fd open_listener(const server_options& options)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    addrinfo* result;
+    if (int status = getaddrinfo(options.hostname, options.port, &hints, &result)) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return unique_fd(-1);
+    }
+    std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> result_guard(result, &freeaddrinfo);
+
+    for (addrinfo* address = result; address; address = address->ai_next) {
+        unique_fd fd(socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol));
+        if (!fd)
+            continue;
+
+        int enable = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+        if (bind(fd, address->ai_addr, address->ai_addrlen) == 0 && listen(fd, options.backlog) == 0)
+            return fd;
+    }
+
+    perror("bind");
+    return unique_fd(-1);
+}
+
+static Task<void> echo(ring_context& context, unique_fd client)
+{
+    std::array<std::byte, 1024 * 16> buffer;
+
+    for (;;) {
+        auto received = co_await context.recv(client, buffer);
+        if (!received || *received == 0)
+            co_return;
+
+        std::span<const std::byte> rest(buffer.data(), *received);
+        while (!rest.empty()) {
+            auto sent = co_await context.send(client, rest);
+            if (!sent)
+                co_return;
+            rest = rest.subspan(*sent);
+        }
+    }
+}
+
+static Task<void> accept_clients(ring_context& context, int listener)
+{
+    for (;;) {
+        auto client = co_await context.accept(listener);
+        if (client)
+            context.spawn(echo(context, std::move(*client)));
+        else if (client.error() != std::errc::connection_aborted)
+            fprintf(stderr, "accept: %s\n", client.error().message().c_str());
+    }
+}
+
+// the ring has nothing to wake the reactor for a stop, a timeout does
+static Task<void> watch_stop(ring_context& context, std::stop_token stop)
+{
+    while (!stop.stop_requested())
+        co_await context.timeout(std::chrono::seconds(1));
+    context.stop();
+}
+
+static void run_reactor(std::stop_token stop, const server_options& options)
+{
+    auto context = ring_context::create(options.entries, options.ring);
+    if (!context) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", context.error().message().c_str());
+        return;
+    }
+
+    unique_fd listener = open_listener(options);
+    if (!listener)
+        return;
+
+    context->spawn(accept_clients(*context, listener));
+    context->spawn(watch_stop(*context, stop));
+    context->run();
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--host NAME] [--port PORT] [--reactors N] [--backlog N] [--entries N] %s\n",
+            name, ring_options_usage);
+}
+
+int main(int argc, char* argv[])
+{
+    server_options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (parse_ring_option(argc, argv, i, options.ring))
+            continue;
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        if (arg == "--host")
+            options.hostname = argv[++i];
+        else if (arg == "--port")
+            options.port = argv[++i];
+        else if (arg == "--reactors")
+            options.reactors = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--backlog")
+            options.backlog = std::max(1l, strtol(argv[++i], nullptr, 10));
+        else if (arg == "--entries")
+            options.entries = std::max(8ul, strtoul(argv[++i], nullptr, 10));
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the reactors inherit the blocked signals, sigwait below takes them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::vector<std::jthread> reactors;
+    for (unsigned index = 0; index < options.reactors; ++index)
+        reactors.emplace_back(run_reactor, std::cref(options));
+
+    int signal_number;
+    sigwait(&signals, &signal_number);
+    fprintf(stderr, "signal %d, stopping\n", signal_number);
+
+    for (auto& reactor : reactors)
+        reactor.request_stop();
+
+    return 0;
+}
@@ -0,0 +1,534 @@
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <stop_token>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ring.h"
+#include "unique_fd.h"
+
+// the echo protocol of socket_server on io_uring. every reactor thread owns
+// a ring, a SO_REUSEPORT listener with a multishot accept, and a provided
+// buffer ring that multishot recvs of all its connections take buffers
+// from. received data goes back out of the same buffer, which returns to
+// the buffer ring once it is sent, so no connection holds a buffer while it
+// is idle. in steady state a reactor makes one io_uring_enter per batch of
+// completions, which submits everything the batch produced.
+
+struct server_options {
+    const char* hostname = "localhost";
+    const char* port = "8080";
+    unsigned reactors = std::max(1u, std::thread::hardware_concurrency());
+    int backlog = 128;
+    unsigned entries = 256;
+    // in the provided buffer ring, a power of 2
+    unsigned buffers = 1024;
+    unsigned buffer_size = 1024 * 16;
+    // buffers a connection may have waiting to be sent before it stops receiving
+    unsigned max_queued = 64;
+    // completions to wait for, at most batch_wait microseconds, before
+    // handling what is there
+    unsigned batch = 1;
+    unsigned batch_wait = 50;
+    // the poller and task run modes, reactor n's poller goes on the cpu
+    // sqpoll_cpu + n, wrapping around
+    ring_options ring;
+};
+
+static unique_fd open_listener(const server_options& options)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    addrinfo* result;
+    if (int status = getaddrinfo(options.hostname, options.port, &hints, &result)) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return unique_fd(-1);
+    }
+    std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> result_guard(result, &freeaddrinfo);
+
+    for (addrinfo* address = result; address; address = address->ai_next) {
+        unique_fd fd(socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol));
+        if (!fd)
+            continue;
+
+        int enable = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+        if (bind(fd, address->ai_addr, address->ai_addrlen) == 0 && listen(fd, options.backlog) == 0)
+            return fd;
+    }
+
+    perror("bind");
+    return unique_fd(-1);
+}
+
+class echo_reactor {
+public:
+    echo_reactor(const server_options& options, unique_ring ring, unique_fd listener) :
+        m_options(options), m_ring(std::move(ring)), m_listener(std::move(listener)) {}
+
+    ~echo_reactor()
+    {
+        for (size_t fd = 0; fd < m_connections.size(); ++fd)
+            if (m_connections[fd].open)
+                close(fd);
+        if (m_buffer_ring)
+            io_uring_free_buf_ring(m_ring.get(), m_buffer_ring, m_options.buffers, buffer_group);
+    }
+
+    bool start()
+    {
+        const size_t size = size_t(m_options.buffers) * m_options.buffer_size;
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        m_memory = std::unique_ptr<char, memory_deleter>(static_cast<char *>(memory), memory_deleter{ size });
+
+        int ret;
+        m_buffer_ring = io_uring_setup_buf_ring(m_ring.get(), m_options.buffers, buffer_group, 0, &ret);
+        if (!m_buffer_ring) {
+            fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-ret));
+            return false;
+        }
+        for (unsigned bid = 0; bid < m_options.buffers; ++bid)
+            recycle(bid);
+        publish();
+
+        accept();
+        return true;
+    }
+
+    void run(std::stop_token stop)
+    {
+        while (!stop.stop_requested()) {
+            if (int ret = wait(); ret < 0 && ret != -ETIME && ret != -EINTR) {
+                fprintf(stderr, "io_uring_enter: %s\n", strerror(-ret));
+                return;
+            }
+
+            io_uring_cqe* cqe;
+            unsigned head;
+            unsigned count = 0;
+            io_uring_for_each_cqe(m_ring.get(), head, cqe) {
+                handle(cqe);
+                ++count;
+            }
+            io_uring_cq_advance(m_ring.get(), count);
+
+            publish();
+        }
+    }
+
+private:
+    // submits everything the last batch produced and waits for the next one,
+    // first up to batch_wait for a whole batch, then for as long as it takes
+    // one completion to come, or a second to check for a stop. there is no
+    // waiting for completions already there, and with the poller awake no
+    // syscall at all.
+    int wait()
+    {
+        io_uring* ring = m_ring.get();
+        if (io_uring_cq_ready(ring) >= m_options.batch)
+            return io_uring_submit(ring);
+
+        io_uring_cqe* cqe;
+        if (m_options.batch > 1) {
+            __kernel_timespec batch_timeout = { .tv_sec = 0, .tv_nsec = m_options.batch_wait * 1000ll };
+            int ret = io_uring_submit_and_wait_timeout(ring, &cqe, m_options.batch, &batch_timeout, nullptr);
+            if (ret != -ETIME || io_uring_cq_ready(ring))
+                return ret;
+        }
+
+        __kernel_timespec timeout = { .tv_sec = 1, .tv_nsec = 0 };
+        return io_uring_submit_and_wait_timeout(ring, &cqe, 1, &timeout, nullptr);
+    }
+
+    static constexpr int buffer_group = 0;
+    static constexpr size_t max_vectors = 64;
+
+    enum class operation : std::uint8_t { accept, recv, send, cancel, close };
+
+    struct memory_deleter {
+        size_t size;
+        void operator()(char* memory) const { munmap(memory, size); }
+    };
+
+    // a received buffer, or what is left of it to send
+    struct chunk {
+        std::uint16_t bid;
+        std::uint32_t begin;
+        std::uint32_t end;
+    };
+
+    struct connection {
+        bool open = false;
+        // a multishot recv is armed
+        bool receiving = false;
+        // its cancellation is on the way
+        bool cancelling = false;
+        // waits for buffers to return to the ring
+        bool starved = false;
+        bool read_closed = false;
+        bool broken = false;
+        // chunks the sendmsg in flight covers, 0 if there is none
+        size_t sending = 0;
+        std::vector<chunk> queue;
+        // the kernel reads these while the sendmsg is in flight
+        msghdr message = {};
+        std::array<iovec, max_vectors> vectors;
+    };
+
+    static std::uint64_t user_data(operation op, int fd)
+    {
+        return std::uint64_t(op) << 32 | std::uint32_t(fd);
+    }
+
+    char* buffer(std::uint16_t bid) const
+    {
+        return m_memory.get() + size_t(bid) * m_options.buffer_size;
+    }
+
+    // hands a buffer back to the kernel, visible after the next publish
+    void recycle(std::uint16_t bid)
+    {
+        io_uring_buf_ring_add(m_buffer_ring, buffer(bid), m_options.buffer_size, bid,
+                              io_uring_buf_ring_mask(m_options.buffers), m_recycled++);
+    }
+
+    // makes the recycled buffers visible with one store, and lets the
+    // connections that ran dry receive again
+    void publish()
+    {
+        if (!m_recycled)
+            return;
+
+        io_uring_buf_ring_advance(m_buffer_ring, m_recycled);
+        m_recycled = 0;
+
+        for (int fd : m_starved) {
+            connection& the_connection = m_connections[fd];
+            if (the_connection.open && the_connection.starved) {
+                the_connection.starved = false;
+                receive(fd);
+            }
+        }
+        m_starved.clear();
+    }
+
+    void accept()
+    {
+        io_uring_sqe* sqe = get_sqe(m_ring.get());
+        io_uring_prep_multishot_accept(sqe, m_listener, nullptr, nullptr, SOCK_CLOEXEC);
+        io_uring_sqe_set_data64(sqe, user_data(operation::accept, m_listener));
+    }
+
+    void receive(int fd)
+    {
+        connection& the_connection = m_connections[fd];
+        if (the_connection.receiving || the_connection.read_closed || the_connection.broken)
+            return;
+
+        io_uring_sqe* sqe = get_sqe(m_ring.get());
+        io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group;
+        io_uring_sqe_set_data64(sqe, user_data(operation::recv, fd));
+        the_connection.receiving = true;
+    }
+
+    // one sendmsg for everything queued, MSG_WAITALL lets the kernel finish
+    // a partial send itself
+    void send(int fd)
+    {
+        connection& the_connection = m_connections[fd];
+        if (the_connection.sending || the_connection.queue.empty())
+            return;
+
+        size_t count = std::min(the_connection.queue.size(), max_vectors);
+        for (size_t index = 0; index < count; ++index) {
+            const chunk& the_chunk = the_connection.queue[index];
+            the_connection.vectors[index] = { buffer(the_chunk.bid) + the_chunk.begin, the_chunk.end - the_chunk.begin };
+        }
+        the_connection.message = {};
+        the_connection.message.msg_iov = the_connection.vectors.data();
+        the_connection.message.msg_iovlen = count;
+
+        io_uring_sqe* sqe = get_sqe(m_ring.get());
+        io_uring_prep_sendmsg(sqe, fd, &the_connection.message, MSG_NOSIGNAL | MSG_WAITALL);
+        io_uring_sqe_set_data64(sqe, user_data(operation::send, fd));
+        the_connection.sending = count;
+    }
+
+    // stops the multishot recv of a connection that can't keep up sending
+    void pause(int fd)
+    {
+        connection& the_connection = m_connections[fd];
+        if (!the_connection.receiving || the_connection.cancelling)
+            return;
+
+        io_uring_sqe* sqe = get_sqe(m_ring.get());
+        io_uring_prep_cancel64(sqe, user_data(operation::recv, fd), 0);
+        io_uring_sqe_set_data64(sqe, user_data(operation::cancel, fd));
+        the_connection.cancelling = true;
+    }
+
+    // closes once nothing is in flight, the peer is done and everything is
+    // sent, or the connection broke
+    void finish(int fd)
+    {
+        connection& the_connection = m_connections[fd];
+        if (the_connection.receiving || the_connection.sending)
+            return;
+        if (!the_connection.broken && !(the_connection.read_closed && the_connection.queue.empty()))
+            return;
+
+        for (const chunk& the_chunk : the_connection.queue)
+            recycle(the_chunk.bid);
+
+        io_uring_sqe* sqe = get_sqe(m_ring.get());
+        io_uring_prep_close(sqe, fd);
+        io_uring_sqe_set_data64(sqe, user_data(operation::close, fd));
+
+        the_connection = connection();
+    }
+
+    void handle(io_uring_cqe* cqe)
+    {
+        const auto op = static_cast<operation>(cqe->user_data >> 32);
+        const int fd = static_cast<int>(cqe->user_data & 0xffffffff);
+        const bool more = cqe->flags & IORING_CQE_F_MORE;
+
+        switch (op) {
+        case operation::accept:
+            if (cqe->res >= 0)
+                opened(cqe->res);
+            else
+                fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+            if (!more)
+                accept();
+            break;
+        case operation::recv:
+            received(fd, cqe, more);
+            break;
+        case operation::send:
+            sent(fd, cqe->res);
+            break;
+        case operation::cancel:
+        case operation::close:
+            // the recv reports the cancellation itself
+            break;
+        }
+    }
+
+    void opened(int fd)
+    {
+        if (size_t(fd) >= m_connections.size())
+            m_connections.resize(fd + 1);
+        m_connections[fd].open = true;
+        receive(fd);
+    }
+
+    void received(int fd, io_uring_cqe* cqe, bool more)
+    {
+        connection& the_connection = m_connections[fd];
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            const auto bid = static_cast<std::uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (cqe->res > 0 && !the_connection.broken)
+                the_connection.queue.push_back({ bid, 0, static_cast<std::uint32_t>(cqe->res) });
+            else
+                recycle(bid);
+        }
+
+        if (!more) {
+            the_connection.receiving = false;
+            the_connection.cancelling = false;
+        }
+
+        if (cqe->res == 0)
+            the_connection.read_closed = true;
+        else if (cqe->res == -ENOBUFS) {
+            // the buffer ring ran dry, receive again once buffers come back
+            if (!the_connection.starved) {
+                the_connection.starved = true;
+                m_starved.push_back(fd);
+            }
+        }
+        else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            if (cqe->res != -ECONNRESET)
+                fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+            the_connection.broken = true;
+        }
+
+        send(fd);
+
+        if (the_connection.queue.size() >= m_options.max_queued)
+            pause(fd);
+        // a multishot recv also ends for reasons of its own and goes on. a
+        // cancelled one waits for the queue to get down to half, unless the
+        // sends already got it there before the cancellation came back.
+        else if (!the_connection.starved &&
+                 (cqe->res != -ECANCELED || the_connection.queue.size() <= m_options.max_queued / 2))
+            receive(fd);
+
+        finish(fd);
+    }
+
+    void sent(int fd, int res)
+    {
+        connection& the_connection = m_connections[fd];
+        const size_t sending = the_connection.sending;
+        the_connection.sending = 0;
+
+        if (res < 0) {
+            if (res != -EPIPE && res != -ECONNRESET)
+                fprintf(stderr, "send: %s\n", strerror(-res));
+            the_connection.broken = true;
+            pause(fd);
+            finish(fd);
+            return;
+        }
+
+        // drop what went out, a short send leaves the rest at the front
+        size_t done = 0;
+        for (size_t remaining = res; done < sending && remaining; ) {
+            chunk& the_chunk = the_connection.queue[done];
+            const size_t size = std::min<size_t>(remaining, the_chunk.end - the_chunk.begin);
+            the_chunk.begin += size;
+            remaining -= size;
+            if (the_chunk.begin != the_chunk.end)
+                break;
+            recycle(the_chunk.bid);
+            ++done;
+        }
+        the_connection.queue.erase(the_connection.queue.begin(), the_connection.queue.begin() + done);
+
+        send(fd);
+
+        // caught up, receive again
+        if (the_connection.queue.size() <= m_options.max_queued / 2 && !the_connection.starved)
+            receive(fd);
+
+        finish(fd);
+    }
+
+    const server_options& m_options;
+    unique_ring m_ring;
+    unique_fd m_listener;
+    std::unique_ptr<char, memory_deleter> m_memory{ nullptr, memory_deleter{ 0 } };
+    io_uring_buf_ring* m_buffer_ring = nullptr;
+    // buffers added to the ring since the last publish
+    int m_recycled = 0;
+    std::vector<int> m_starved;
+    // indexed by descriptor number. a deque, growing it must not move the
+    // msghdr of a prepared sendmsg that the kernel reads on submission.
+    std::deque<connection> m_connections;
+};
+
+static void run_reactor(std::stop_token stop, const server_options& options, unsigned index)
+{
+    ring_options setup = options.ring;
+    if (setup.sqpoll_cpu >= 0)
+        setup.sqpoll_cpu = (setup.sqpoll_cpu + index) % std::max(1u, std::thread::hardware_concurrency());
+
+    // the multishot recvs of all connections complete into one ring. it is
+    // made on the thread that uses it, which a single issuer ring requires.
+    auto ring = make_ring(options.entries, options.entries * 8, setup);
+    if (!ring) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", ring.error().message().c_str());
+        return;
+    }
+
+    unique_fd listener = open_listener(options);
+    if (!listener)
+        return;
+
+    echo_reactor reactor(options, std::move(*ring), std::move(listener));
+    if (reactor.start())
+        reactor.run(stop);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--host NAME] [--port PORT] [--reactors N] [--backlog N] [--entries N]"
+                    " [--buffers N] [--buffer-size BYTES] [--max-queued N] [--batch N] [--batch-wait US] %s\n",
+            name, ring_options_usage);
+}
+
+int main(int argc, char* argv[])
+{
+    server_options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (parse_ring_option(argc, argv, i, options.ring))
+            continue;
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        if (arg == "--host")
+            options.hostname = argv[++i];
+        else if (arg == "--port")
+            options.port = argv[++i];
+        else if (arg == "--reactors")
+            options.reactors = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--backlog")
+            options.backlog = std::max(1l, strtol(argv[++i], nullptr, 10));
+        else if (arg == "--entries")
+            options.entries = std::max(8ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--buffers")
+            options.buffers = std::bit_ceil(std::clamp(strtoul(argv[++i], nullptr, 10), 1ul, 32768ul));
+        else if (arg == "--buffer-size")
+            options.buffer_size = std::max(64ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--max-queued")
+            options.max_queued = std::max(2ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--batch")
+            options.batch = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--batch-wait")
+            options.batch_wait = std::min(999999ul, strtoul(argv[++i], nullptr, 10));
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the reactors inherit the blocked signals, sigwait below takes them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::vector<std::jthread> reactors;
+    for (unsigned index = 0; index < options.reactors; ++index)
+        reactors.emplace_back(run_reactor, std::cref(options), index);
+
+    int signal_number;
+    sigwait(&signals, &signal_number);
+    fprintf(stderr, "signal %d, stopping\n", signal_number);
+
+    for (auto& reactor : reactors)
+        reactor.request_stop();
+
+    return 0;
+}
@@ -0,0 +1,252 @@
+#ifndef IO_URING_FILE_READER_H
+#define IO_URING_FILE_READER_H
+
+#include <liburing.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <expected>
+#include <memory>
+#include <span>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "ring.h"
+#include "unique_fd.h"
+
+struct file_reader_options {
+    // reads in flight, and the number of buffers
+    unsigned queue_depth = 128;
+    // bytes per read, a multiple of the logical block size with O_DIRECT
+    std::size_t block_size = 1024 * 128;
+    // bypass the page cache
+    bool direct = false;
+    // IORING_OP_READ_FIXED from buffers registered once, instead of mapping
+    // the buffer on every read, and a registered file table
+    bool fixed = true;
+    // completions to wait for before reaping and refilling, more means
+    // fewer io_uring_enter calls and a shallower queue in between
+    unsigned batch = 1;
+    // the poller and task run modes
+    ring_options ring;
+};
+
+// reads whole files through one io_uring, keeping queue_depth block reads
+// in flight across all of them. completions are reaped in batches, and
+// every batch of new reads goes in with the same io_uring_enter that waits
+// for the next completions.
+class file_reader {
+public:
+    // buffers are aligned for O_DIRECT
+    static constexpr std::size_t alignment = 4096;
+
+    static std::expected<file_reader, std::error_code> create(const file_reader_options& options = {})
+    {
+        if (options.queue_depth == 0 || options.block_size == 0 || options.block_size > UINT32_MAX || options.batch == 0)
+            return std::unexpected(std::make_error_code(std::errc::invalid_argument));
+
+        auto ring = make_ring(options.queue_depth, 0, options.ring);
+        if (!ring)
+            return std::unexpected(ring.error());
+
+        const std::size_t block = (options.block_size + alignment - 1) / alignment * alignment;
+        std::unique_ptr<std::byte[], decltype(&free)> buffers(
+            static_cast<std::byte*>(std::aligned_alloc(alignment, block * options.queue_depth)), &free);
+        if (!buffers)
+            return std::unexpected(std::make_error_code(std::errc::not_enough_memory));
+
+        file_reader reader(options, std::move(*ring), std::move(buffers), block);
+
+        // pinning the buffers can fail on RLIMIT_MEMLOCK, plain reads still work
+        if (options.fixed) {
+            std::vector<iovec> vectors(options.queue_depth);
+            for (unsigned index = 0; index < options.queue_depth; ++index)
+                vectors[index] = { reader.buffer(index), options.block_size };
+            reader.m_fixed_buffers = io_uring_register_buffers(reader.m_ring.get(), vectors.data(), vectors.size()) == 0;
+        }
+
+        return reader;
+    }
+
+    const file_reader_options& options() const { return m_options; }
+
+    // whether reads go to registered buffers, registering can fail
+    bool fixed_buffers() const { return m_fixed_buffers; }
+
+    // reads every file from start to end, calling
+    // consume(file index, offset, std::span<const std::byte>) for each
+    // block in completion order. the data is only valid during the call.
+    // returns the bytes read, or the first error, once no read is in flight.
+    template<class F>
+    std::expected<std::uint64_t, std::error_code> read(std::span<const std::string> paths, F&& consume)
+    {
+        std::vector<unique_fd> files;
+        std::vector<std::uint64_t> sizes;
+        for (const std::string& path : paths) {
+            unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC | (m_options.direct ? O_DIRECT : 0)));
+            if (!fd)
+                return std::unexpected(std::error_code(errno, std::system_category()));
+
+            struct stat status;
+            if (fstat(fd, &status) == -1)
+                return std::unexpected(std::error_code(errno, std::system_category()));
+
+            files.push_back(std::move(fd));
+            sizes.push_back(status.st_size);
+        }
+
+        // sqes name files by their index in the registered table
+        bool fixed_files = false;
+        if (m_options.fixed && !files.empty()) {
+            std::vector<int> table(files.begin(), files.end());
+            fixed_files = io_uring_register_files(m_ring.get(), table.data(), table.size()) == 0;
+        }
+
+        // walks the files block by block, retries and the rest of short reads go first
+        std::vector<request> retries;
+        std::size_t next_file = 0;
+        std::uint64_t next_offset = 0;
+        auto next_request = [&](request& the_request) {
+            if (!retries.empty()) {
+                the_request = retries.back();
+                retries.pop_back();
+                return true;
+            }
+            while (next_file < files.size() && next_offset >= sizes[next_file]) {
+                ++next_file;
+                next_offset = 0;
+            }
+            if (next_file == files.size())
+                return false;
+
+            // a whole block even at the end, O_DIRECT wants aligned lengths
+            the_request = { static_cast<unsigned>(next_file), next_offset, static_cast<unsigned>(m_options.block_size) };
+            next_offset += m_options.block_size;
+            return true;
+        };
+
+        std::vector<unsigned> free_slots(m_options.queue_depth);
+        for (unsigned slot = 0; slot < m_options.queue_depth; ++slot)
+            free_slots[slot] = m_options.queue_depth - 1 - slot;
+
+        std::vector<io_uring_cqe*> cqes(m_options.queue_depth);
+        std::uint64_t total = 0;
+        std::error_code error;
+        unsigned in_flight = 0;
+
+        for (;;) {
+            // fill every free slot, unless an error stops new reads
+            while (!error && !free_slots.empty()) {
+                request& the_request = m_requests[free_slots.back()];
+                if (!next_request(the_request))
+                    break;
+
+                unsigned slot = free_slots.back();
+                free_slots.pop_back();
+                prepare(slot, the_request, fixed_files ? static_cast<int>(the_request.file) : static_cast<int>(files[the_request.file]), fixed_files);
+                ++in_flight;
+            }
+
+            if (in_flight == 0)
+                break;
+
+            // submits what was prepared and waits for a batch of completions,
+            // or whatever is left in flight. with the poller the submission
+            // needs no syscall and completions already there need no wait.
+            // anything but a transient error leaves reads in the ring that
+            // can't be waited for, the reader is no use after that.
+            const unsigned wait = std::min(m_options.batch, in_flight);
+            int ret = io_uring_cq_ready(m_ring.get()) >= wait ? io_uring_submit(m_ring.get())
+                                                              : io_uring_submit_and_wait(m_ring.get(), wait);
+            if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+                if (fixed_files)
+                    io_uring_unregister_files(m_ring.get());
+                return std::unexpected(std::error_code(-ret, std::system_category()));
+            }
+
+            unsigned count = io_uring_peek_batch_cqe(m_ring.get(), cqes.data(), cqes.size());
+            for (unsigned index = 0; index < count; ++index) {
+                const unsigned slot = static_cast<unsigned>(io_uring_cqe_get_data64(cqes[index]));
+                const int res = cqes[index]->res;
+                request& the_request = m_requests[slot];
+                --in_flight;
+
+                if (res == -EAGAIN || res == -EINTR) {
+                    retries.push_back(the_request);
+                } else if (res < 0) {
+                    if (!error)
+                        error = std::error_code(-res, std::system_category());
+                } else if (res > 0) {
+                    consume(the_request.file, the_request.offset, std::span<const std::byte>(buffer(slot), res));
+                    total += res;
+
+                    // a short read before the end of the file, read the rest
+                    request rest = { the_request.file, the_request.offset + res, the_request.length - res };
+                    if (rest.length && rest.offset < sizes[rest.file])
+                        retries.push_back(rest);
+                }
+                // 0, the file got shorter since fstat
+
+                free_slots.push_back(slot);
+            }
+            io_uring_cq_advance(m_ring.get(), count);
+        }
+
+        if (fixed_files)
+            io_uring_unregister_files(m_ring.get());
+
+        if (error)
+            return std::unexpected(error);
+        return total;
+    }
+
+private:
+    // one block read, or the rest of one
+    struct request {
+        unsigned file;
+        std::uint64_t offset;
+        unsigned length;
+    };
+
+    file_reader(const file_reader_options& options, unique_ring ring,
+                std::unique_ptr<std::byte[], decltype(&free)> buffers, std::size_t block) :
+        m_options(options), m_ring(std::move(ring)), m_buffers(std::move(buffers)), m_block(block),
+        m_requests(options.queue_depth) {}
+
+    std::byte* buffer(unsigned slot) const
+    {
+        return m_buffers.get() + slot * m_block;
+    }
+
+    // there are never more reads in flight than entries, but the poller may
+    // not have taken the last submissions off the queue yet
+    void prepare(unsigned slot, const request& the_request, int fd, bool fixed_file)
+    {
+        io_uring_sqe* sqe = get_sqe(m_ring.get());
+        if (m_fixed_buffers)
+            io_uring_prep_read_fixed(sqe, fd, buffer(slot), the_request.length, the_request.offset, slot);
+        else
+            io_uring_prep_read(sqe, fd, buffer(slot), the_request.length, the_request.offset);
+
+        io_uring_sqe_set_flags(sqe, fixed_file ? IOSQE_FIXED_FILE : 0);
+        io_uring_sqe_set_data64(sqe, slot);
+    }
+
+    file_reader_options m_options;
+    unique_ring m_ring;
+    std::unique_ptr<std::byte[], decltype(&free)> m_buffers;
+    // block_size rounded up to the alignment, the distance between buffers
+    std::size_t m_block;
+    std::vector<request> m_requests;
+    bool m_fixed_buffers = false;
+};
+
+#endif
@@ -1,101 +1,76 @@
-#include <liburing.h>
-#include <fcntl.h>
-#include <string.h>
-#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include <memory>
-
-class unique_fd {
-public:
-    unique_fd(int fd) : m_fd(fd) {}
-    unique_fd(unique_fd&& uf) { m_fd = uf.m_fd; uf.m_fd = -1; }
-    ~unique_fd() { if (m_fd != -1) close(m_fd); }
-
-    explicit operator bool() const { return m_fd != -1; }
-    operator int() const { return m_fd; }
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
 
-private:
-    int m_fd;
+#include "file_reader.h"
 
-    unique_fd(const unique_fd&) = delete;
-    unique_fd& operator=(const unique_fd&) = delete;
-};
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--queue-depth N] [--block-size BYTES] [--batch N] [--direct] [--no-fixed] %s <file>...\n",
+            name, ring_options_usage);
+}
 
 int main(int argc, char *argv[])
 {
-    constexpr int queue_depth = 1;
-    constexpr int block_size = 4096;
-
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <file>\n", argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    const char *file_path = argv[1];
-
-    // 初始化 io_uring
-    struct io_uring ring;
-    int ret = io_uring_queue_init(queue_depth, &ring, 0);
-    if (ret < 0) {
-        errno = -ret;
-        perror("io_uring_queue_init");
-        return 1;
+    file_reader_options options;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--direct")
+            options.direct = true;
+        else if (arg == "--no-fixed")
+            options.fixed = false;
+        else if (arg == "--queue-depth" && i + 1 < argc)
+            options.queue_depth = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--block-size" && i + 1 < argc)
+            options.block_size = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--batch" && i + 1 < argc)
+            options.batch = strtoul(argv[++i], nullptr, 10);
+        else if (parse_ring_option(argc, argv, i, options.ring))
+            continue;
+        else if (arg.starts_with("--")) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        else
+            paths.emplace_back(arg);
     }
 
-    // 用智能指針來管理 io_uring 資源
-    std::unique_ptr<io_uring, decltype(&io_uring_queue_exit)> ring_guard(&ring, &io_uring_queue_exit);
-
-    // 開啟文件
-    int fd = open(file_path, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        return 1;
-    }
-
-    // // 用智能指針來管理文件描述符
-    unique_fd fd_guard(fd);
-
-    // 分配內存來保存讀取的數據
-    char *buf = (char*)malloc(block_size);
-    if (!buf) {
-        perror("malloc");
-        return 1;
-    }
-
-    // 用智能指針來管理內存
-    std::unique_ptr<char[], decltype(&free)> buf_guard(buf, &free);
-
-    // 提交讀取請求
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    if (!sqe) {
-        fprintf(stderr, "io_uring_get_sqe failed\n");
-        return 1;
+    if (paths.empty()) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
     }
 
-    io_uring_prep_read(sqe, fd, buf, block_size, 0);
-    io_uring_sqe_set_data(sqe, (void*)file_path);
-
-    io_uring_submit(&ring);
-
-    // 等待完成隊列條目
-    struct io_uring_cqe *cqe;
-    ret = io_uring_wait_cqe(&ring, &cqe);
-    if (ret < 0) {
-        errno = -ret;
-        perror("io_uring_wait_cqe");
-        return 1;
+    auto reader = file_reader::create(options);
+    if (!reader) {
+        fprintf(stderr, "file_reader: %s\n", reader.error().message().c_str());
+        return EXIT_FAILURE;
     }
 
-    if (cqe->res < 0) {
-        fprintf(stderr, "Async readv failed: %s\n", strerror(-cqe->res));
-    } else {
-        printf("%s Read %d bytes: %.*s\n", (char*)cqe->user_data, cqe->res, cqe->res, buf);
+    // 逐塊累加內容，確認每個位元組都讀到了
+    std::uint64_t checksum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto total = reader->read(paths, [&](unsigned, std::uint64_t, std::span<const std::byte> data) {
+        for (std::byte value : data)
+            checksum += static_cast<unsigned char>(value);
+    });
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!total) {
+        fprintf(stderr, "read: %s\n", total.error().message().c_str());
+        return EXIT_FAILURE;
     }
 
-    // 釋放完成隊列條目
-    io_uring_cqe_seen(&ring, cqe);
+    printf("%zu files, %llu bytes in %.3f s, %.2f GB/s, fixed buffers %s, checksum %llu\n",
+           paths.size(), static_cast<unsigned long long>(*total), seconds,
+           seconds > 0 ? *total / seconds / 1e9 : 0.0, reader->fixed_buffers() ? "yes" : "no",
+           static_cast<unsigned long long>(checksum));
 
     return 0;
 }
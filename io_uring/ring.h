@@ -0,0 +1,119 @@
+#ifndef IO_URING_RING_H
+#define IO_URING_RING_H
+
+#include <liburing.h>
+
+#include <cstdlib>
+#include <expected>
+#include <memory>
+#include <string_view>
+#include <system_error>
+
+struct ring_deleter {
+    void operator()(io_uring* ring) const
+    {
+        io_uring_queue_exit(ring);
+        delete ring;
+    }
+};
+
+// an io_uring that io_uring_queue_exit tears down
+using unique_ring = std::unique_ptr<io_uring, ring_deleter>;
+
+// how a ring is set up, apart from its size
+struct ring_options {
+    // a kernel thread polls the submission queue, so submitting takes no
+    // syscall while it is awake. it costs that thread's core.
+    bool sqpoll = false;
+    // the cpu the poller is pinned to, any if negative
+    int sqpoll_cpu = -1;
+    // milliseconds without submissions before the poller sleeps and the
+    // next submission has to wake it
+    unsigned sqpoll_idle = 1000;
+    // completions don't interrupt the thread, they wait for it to enter
+    // the kernel, which it does every loop anyway
+    bool coop_taskrun = false;
+    // only the thread that creates the ring submits to it, the kernel
+    // skips the locking
+    bool single_issuer = false;
+    // completion work runs only when the thread waits for completions,
+    // in one batch. implies single_issuer.
+    bool defer_taskrun = false;
+};
+
+// a ring with entries submission slots, and cq_entries completion slots
+// instead of the kernel's twice entries if it isn't 0. the poller doesn't
+// go with the task run flags, the kernel refuses those combinations.
+inline std::expected<unique_ring, std::error_code> make_ring(unsigned entries, unsigned cq_entries = 0,
+                                                             const ring_options& options = {})
+{
+    if (options.sqpoll && (options.coop_taskrun || options.defer_taskrun))
+        return std::unexpected(std::make_error_code(std::errc::invalid_argument));
+
+    io_uring_params params = {};
+    if (cq_entries) {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+    }
+    if (options.sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = options.sqpoll_idle;
+        if (options.sqpoll_cpu >= 0) {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = options.sqpoll_cpu;
+        }
+    }
+    if (options.coop_taskrun)
+        params.flags |= IORING_SETUP_COOP_TASKRUN;
+    if (options.single_issuer || options.defer_taskrun)
+        params.flags |= IORING_SETUP_SINGLE_ISSUER;
+    if (options.defer_taskrun)
+        params.flags |= IORING_SETUP_DEFER_TASKRUN;
+
+    auto uninitialized = std::make_unique<io_uring>();
+    if (int ret = io_uring_queue_init_params(entries, uninitialized.get(), &params); ret < 0)
+        return std::unexpected(std::error_code(-ret, std::system_category()));
+    return unique_ring(uninitialized.release());
+}
+
+// the next free sqe, submitting what is queued first if there is none
+inline io_uring_sqe* get_sqe(io_uring* ring)
+{
+    io_uring_sqe* sqe = io_uring_get_sqe(ring);
+    while (!sqe) {
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
+    }
+    return sqe;
+}
+
+// takes argv[i], and its value from argv[i + 1], if it is one of
+// --sqpoll, --sqpoll-cpu N, --sqpoll-idle MS, --coop-taskrun,
+// --single-issuer or --defer-taskrun
+inline bool parse_ring_option(int argc, char* argv[], int& i, ring_options& options)
+{
+    std::string_view arg = argv[i];
+    if (arg == "--sqpoll")
+        options.sqpoll = true;
+    else if (arg == "--coop-taskrun")
+        options.coop_taskrun = true;
+    else if (arg == "--single-issuer")
+        options.single_issuer = true;
+    else if (arg == "--defer-taskrun")
+        options.defer_taskrun = true;
+    else if (arg == "--sqpoll-cpu" && i + 1 < argc) {
+        options.sqpoll = true;
+        options.sqpoll_cpu = std::strtol(argv[++i], nullptr, 10);
+    } else if (arg == "--sqpoll-idle" && i + 1 < argc) {
+        options.sqpoll = true;
+        options.sqpoll_idle = std::strtoul(argv[++i], nullptr, 10);
+    } else
+        return false;
+    return true;
+}
+
+// what parse_ring_option takes, for usage messages
+inline constexpr const char ring_options_usage[] =
+    "[--sqpoll] [--sqpoll-cpu N] [--sqpoll-idle MS] [--coop-taskrun] [--single-issuer] [--defer-taskrun]";
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef IO_URING_RING_CONTEXT_H
+#define IO_URING_RING_CONTEXT_H
+
+#include <liburing.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <expected>
+#include <memory>
+#include <span>
+#include <system_error>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "Task.h"
+#include "ring.h"
+#include "unique_fd.h"
+
+// io_uring operations as awaitables. co_await context.recv(fd, buffer)
+// puts one sqe in the ring whose user_data points at the awaiter, which
+// lives in the awaiting coroutine's frame, and run() resumes the coroutine
+// with the result once its completion comes. coroutines compose as Task<T>
+// and start with spawn(). everything runs on the thread that calls run(),
+// nothing may await the context from another thread.
+class ring_context {
+public:
+    // the result of a read, write, recv or send, the bytes transferred
+    using size_result = std::expected<std::size_t, std::error_code>;
+
+    static std::expected<ring_context, std::error_code> create(unsigned entries = 256, const ring_options& options = {})
+    {
+        auto ring = make_ring(entries, entries * 2, options);
+        if (!ring)
+            return std::unexpected(ring.error());
+        return ring_context(std::move(*ring), entries * 2);
+    }
+
+    ring_context(ring_context&&) = default;
+    ring_context& operator=(ring_context&&) = delete;
+
+    // the ring goes first, no completion may come for a frame destroyed below
+    ~ring_context()
+    {
+        m_ring.reset();
+        for (void* frame : m_spawned)
+            std::coroutine_handle<>::from_address(frame).destroy();
+    }
+
+    io_uring* ring() const { return m_ring.get(); }
+
+    // runs task on this thread until its first suspension. an exception
+    // that escapes it comes out of run(). the context must not move once
+    // something is spawned.
+    void spawn(Task<void> task)
+    {
+        start(std::move(task));
+    }
+
+    // resumes coroutines as their operations complete until none are left,
+    // stop() is called, or the ones left wait for nothing in the ring
+    void run()
+    {
+        m_stopped = false;
+        std::vector<io_uring_cqe*> cqes(m_cq_entries);
+        std::vector<std::pair<operation*, io_uring_cqe>> ready;
+
+        while (!m_stopped && !m_spawned.empty() && m_in_flight > 0) {
+            if (int ret = io_uring_submit_and_wait(m_ring.get(), 1); ret < 0 && ret != -EINTR && ret != -EBUSY)
+                throw std::system_error(-ret, std::system_category(), "io_uring_submit_and_wait");
+
+            // the completions are copied out and seen before anything is
+            // resumed, the coroutines submit more while they run
+            unsigned count = io_uring_peek_batch_cqe(m_ring.get(), cqes.data(), cqes.size());
+            ready.clear();
+            for (unsigned index = 0; index < count; ++index)
+                ready.emplace_back(static_cast<operation*>(io_uring_cqe_get_data(cqes[index])), *cqes[index]);
+            io_uring_cq_advance(m_ring.get(), count);
+            m_in_flight -= count;
+
+            for (auto& [the_operation, cqe] : ready) {
+                the_operation->res = cqe.res;
+                the_operation->flags = cqe.flags;
+                the_operation->waiting.resume();
+            }
+
+            if (m_error)
+                std::rethrow_exception(std::exchange(m_error, nullptr));
+        }
+    }
+
+    // makes run() return after the completions at hand
+    void stop() { m_stopped = true; }
+
+    auto read(int fd, std::span<std::byte> buffer, std::uint64_t offset)
+    {
+        return awaitable(to_size, [=](io_uring_sqe* sqe) {
+            io_uring_prep_read(sqe, fd, buffer.data(), buffer.size(), offset);
+        });
+    }
+
+    auto write(int fd, std::span<const std::byte> buffer, std::uint64_t offset)
+    {
+        return awaitable(to_size, [=](io_uring_sqe* sqe) {
+            io_uring_prep_write(sqe, fd, buffer.data(), buffer.size(), offset);
+        });
+    }
+
+    auto recv(int fd, std::span<std::byte> buffer, int flags = 0)
+    {
+        return awaitable(to_size, [=](io_uring_sqe* sqe) {
+            io_uring_prep_recv(sqe, fd, buffer.data(), buffer.size(), flags);
+        });
+    }
+
+    auto send(int fd, std::span<const std::byte> buffer, int flags = MSG_NOSIGNAL)
+    {
+        return awaitable(to_size, [=](io_uring_sqe* sqe) {
+            io_uring_prep_send(sqe, fd, buffer.data(), buffer.size(), flags);
+        });
+    }
+
+    // the accepted connection
+    auto accept(int fd, int flags = SOCK_CLOEXEC)
+    {
+        return awaitable(to_fd, [=](io_uring_sqe* sqe) {
+            io_uring_prep_accept(sqe, fd, nullptr, nullptr, flags);
+        });
+    }
+
+    // resumes after duration, the timespec lives in the awaiter until then
+    auto timeout(std::chrono::nanoseconds duration)
+    {
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration);
+        return awaitable(to_void, [time = __kernel_timespec{ .tv_sec = seconds.count(),
+                                                             .tv_nsec = (duration - seconds).count() }]
+                                  (io_uring_sqe* sqe) mutable {
+            io_uring_prep_timeout(sqe, &time, 0, 0);
+        });
+    }
+
+private:
+    // what a completion reports to the awaiter it points at
+    struct operation {
+        std::coroutine_handle<> waiting;
+        int res = 0;
+        std::uint32_t flags = 0;
+    };
+
+    template<class Result, class Prepare>
+    class awaiter : operation {
+    public:
+        awaiter(ring_context& context, Result result, Prepare prepare) :
+            m_context(context), m_result(result), m_prepare(std::move(prepare)) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            this->waiting = handle;
+            io_uring_sqe* sqe = get_sqe(m_context.m_ring.get());
+            m_prepare(sqe);
+            io_uring_sqe_set_data(sqe, static_cast<operation*>(this));
+            ++m_context.m_in_flight;
+        }
+
+        auto await_resume() const { return m_result(this->res); }
+
+    private:
+        ring_context& m_context;
+        Result m_result;
+        Prepare m_prepare;
+    };
+
+    // the coroutine spawn() starts, it keeps the spawned task alive and
+    // takes itself off the context when the task is done
+    struct spawned {
+        struct promise_type {
+            promise_type(ring_context& context, Task<void>&) : context(context) {}
+
+            spawned get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept
+            {
+                context.m_spawned.insert(std::coroutine_handle<promise_type>::from_promise(*this).address());
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept
+            {
+                context.m_spawned.erase(std::coroutine_handle<promise_type>::from_promise(*this).address());
+                return {};
+            }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+
+            ring_context& context;
+        };
+    };
+
+    ring_context(unique_ring ring, unsigned cq_entries) : m_ring(std::move(ring)), m_cq_entries(cq_entries) {}
+
+    template<class Result, class Prepare>
+    awaiter<Result, Prepare> awaitable(Result result, Prepare prepare)
+    {
+        return awaiter<Result, Prepare>(*this, result, std::move(prepare));
+    }
+
+    spawned start(Task<void> task)
+    {
+        try {
+            co_await std::move(task);
+        } catch (...) {
+            if (!m_error)
+                m_error = std::current_exception();
+        }
+    }
+
+    static size_result to_size(int res)
+    {
+        if (res < 0)
+            return std::unexpected(std::error_code(-res, std::system_category()));
+        return static_cast<std::size_t>(res);
+    }
+
+    static std::expected<unique_fd, std::error_code> to_fd(int res)
+    {
+        if (res < 0)
+            return std::unexpected(std::error_code(-res, std::system_category()));
+        return unique_fd(res);
+    }
+
+    // a timeout reports -ETIME when it expires, which is what was asked for
+    static std::expected<void, std::error_code> to_void(int res)
+    {
+        if (res < 0 && res != -ETIME)
+            return std::unexpected(std::error_code(-res, std::system_category()));
+        return {};
+    }
+
+    unique_ring m_ring;
+    unsigned m_cq_entries;
+    // operations submitted whose completion hasn't been reaped
+    std::size_t m_in_flight = 0;
+    // the frames of the spawned tasks that haven't finished, destroyed
+    // with the context
+    std::unordered_set<void*> m_spawned;
+    std::exception_ptr m_error;
+    bool m_stopped = false;
+};
+
+#endif
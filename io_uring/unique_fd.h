@@ -0,0 +1,22 @@
+#ifndef IO_URING_UNIQUE_FD_H
+#define IO_URING_UNIQUE_FD_H
+
+#include <unistd.h>
+
+class unique_fd {
+public:
+    unique_fd(int fd) : m_fd(fd) {}
+    unique_fd(unique_fd&& uf) noexcept { m_fd = uf.m_fd; uf.m_fd = -1; }
+    ~unique_fd() { if (m_fd != -1) close(m_fd); }
+
+    explicit operator bool() const { return m_fd != -1; }
+    operator int() const { return m_fd; }
+
+private:
+    int m_fd;
+
+    unique_fd(const unique_fd&) = delete;
+    unique_fd& operator=(const unique_fd&) = delete;
+};
+
+#endif
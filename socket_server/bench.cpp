@@ -0,0 +1,262 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <csignal>
+#include <netdb.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// runs socket_server as a child process in each configuration, streams
+// blocks through echo connections for a while, and reports the throughput
+// and the server's cpu time per GB echoed, from the rusage of the child.
+// with --uring-server the io_uring echo server runs through the same client.
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_settings
+{
+    std::string server = "./socket_server";
+    // io_uring_echo_server, its configuration is skipped without one
+    std::string uring_server;
+    std::string port = "9090";
+    unsigned reactors = 1;
+    unsigned connections = 4;
+    std::size_t block = 1024 * 64;
+    double seconds = 3;
+    std::string config;
+};
+
+struct bench_config
+{
+    std::string name;
+    std::vector<std::string> arguments;
+    bool uring = false;
+};
+
+// the copy path against zero copy, with the handler on the reactor, where
+// echo bytes are spliced, and on a pool, where responses are MSG_ZEROCOPY sends
+static std::vector<bench_config> configs()
+{
+    return {
+        { "copy", {} },
+        { "zero_copy", { "--zero-copy" } },
+        { "copy_pool", { "--pool", "2" } },
+        { "zero_copy_pool", { "--zero-copy", "--pool", "2" } },
+        { "io_uring", {}, true },
+        { "io_uring_sqpoll", { "--sqpoll" }, true },
+        { "io_uring_defer_taskrun", { "--defer-taskrun", "--batch", "8" }, true },
+    };
+}
+
+static pid_t start_server(const bench_settings& settings, const bench_config& config)
+{
+    std::vector<std::string> arguments = {
+        config.uring ? settings.uring_server : settings.server,
+        "--port", settings.port, "--reactors", std::to_string(settings.reactors)
+    };
+    if (!config.uring)
+        arguments.insert(std::end(arguments), { "--no-resolve", "--log-level", "warning" });
+    arguments.insert(std::end(arguments), std::begin(config.arguments), std::end(config.arguments));
+
+    pid_t pid = ::fork();
+    if (pid == 0)
+    {
+        std::vector<char*> argv;
+        for (auto& argument : arguments)
+            argv.push_back(std::data(argument));
+        argv.push_back(nullptr);
+
+        ::execv(argv[0], std::data(argv));
+        std::println(std::cerr, "execv {}: {}", argv[0], std::strerror(errno));
+        ::_exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+static int connect_to(const bench_settings& settings)
+{
+    addrinfo hints =
+    {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+    addrinfo* result;
+    if (::getaddrinfo("localhost", settings.port.c_str(), &hints, &result) != 0)
+        return -1;
+
+    int fd = -1;
+    for (auto* address = result; address && fd == -1; address = address->ai_next)
+    {
+        fd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd != -1 && ::connect(fd, address->ai_addr, address->ai_addrlen) == -1)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(result);
+    return fd;
+}
+
+// what one configuration measured
+struct bench_result
+{
+    std::uint64_t bytes = 0;
+    double seconds = 0;
+    double user_seconds = 0;
+    double system_seconds = 0;
+};
+
+// a writer and a reader thread per connection. the writers stop after
+// settings.seconds and shut down their side, the readers count echoed
+// bytes until the server closes in turn.
+static bool run(const bench_settings& settings, const bench_config& config, bench_result& result)
+{
+    pid_t pid = start_server(settings, config);
+    if (pid == -1)
+        return false;
+
+    std::vector<int> fds;
+    for (unsigned i = 0; i < settings.connections; ++i)
+    {
+        int fd = -1;
+        // the server takes a moment to listen
+        for (int attempt = 0; attempt < 100 && fd == -1; ++attempt)
+            if ((fd = connect_to(settings)) == -1)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (fd == -1)
+            break;
+        fds.push_back(fd);
+    }
+
+    std::atomic<std::uint64_t> received{0};
+    const auto start = bench_clock::now();
+    const auto until = start + std::chrono::duration<double>(settings.seconds);
+    {
+        std::vector<std::jthread> threads;
+        for (int fd : fds)
+        {
+            threads.emplace_back([fd, &settings, until]
+            {
+                std::string block(settings.block, 'x');
+                while (bench_clock::now() < until)
+                    if (::send(fd, std::data(block), std::size(block), MSG_NOSIGNAL) == -1)
+                        break;
+                ::shutdown(fd, SHUT_WR);
+            });
+
+            threads.emplace_back([fd, &settings, &received]
+            {
+                std::vector<char> buffer(settings.block);
+                for (;;)
+                {
+                    auto size = ::recv(fd, std::data(buffer), std::size(buffer), 0);
+                    if (size <= 0)
+                        break;
+                    received.fetch_add(size, std::memory_order_relaxed);
+                }
+            });
+        }
+    }
+    result.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    result.bytes = received.load();
+
+    for (int fd : fds)
+        ::close(fd);
+
+    ::kill(pid, SIGINT);
+    int status;
+    rusage usage;
+    if (::wait4(pid, &status, 0, &usage) == -1)
+        return false;
+
+    result.user_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    result.system_seconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    return std::size(fds) == settings.connections;
+}
+
+static void report(const bench_settings& settings, const bench_config& config, const bench_result& result)
+{
+    const double gigabytes = result.bytes / 1e9;
+    const double cpu_seconds = result.user_seconds + result.system_seconds;
+
+    std::println("{{\"config\":\"{}\",\"connections\":{},\"block\":{},\"seconds\":{:.3f},\"bytes\":{}"
+                 ",\"bytes_per_sec\":{:.0f},\"server_user_s\":{:.3f},\"server_sys_s\":{:.3f},\"cpu_s_per_gb\":{:.3f}}}",
+                 config.name, settings.connections, settings.block, result.seconds, result.bytes,
+                 result.seconds > 0 ? result.bytes / result.seconds : 0.0,
+                 result.user_seconds, result.system_seconds,
+                 gigabytes > 0 ? cpu_seconds / gigabytes : 0.0);
+}
+
+static void usage(const char* name)
+{
+    std::println(std::cerr, "Usage: {} [--server PATH] [--uring-server PATH] [--port PORT] [--reactors N] [--connections N]"
+                            " [--block BYTES] [--seconds S] [--config NAME]\n"
+                            "Prints one JSON object per server configuration.", name);
+}
+
+int main(int argc, char* argv[])
+{
+    bench_settings settings;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        if (arg == "--server")
+            settings.server = argv[++i];
+        else if (arg == "--uring-server")
+            settings.uring_server = argv[++i];
+        else if (arg == "--port")
+            settings.port = argv[++i];
+        else if (arg == "--reactors")
+            settings.reactors = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--connections")
+            settings.connections = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--block")
+            settings.block = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--seconds")
+            settings.seconds = std::strtod(argv[++i], nullptr);
+        else if (arg == "--config")
+            settings.config = argv[++i];
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (const bench_config& config : configs())
+    {
+        if (!settings.config.empty() && settings.config != config.name)
+            continue;
+        if (config.uring && settings.uring_server.empty())
+            continue;
+
+        bench_result result;
+        if (!run(settings, config, result))
+        {
+            std::println(std::cerr, "{}: couldn't run {}", config.name,
+                         config.uring ? settings.uring_server : settings.server);
+            return EXIT_FAILURE;
+        }
+        report(settings, config, result);
+    }
+
+    return EXIT_SUCCESS;
+}
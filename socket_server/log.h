@@ -0,0 +1,272 @@
+#ifndef SOCKET_SERVER_LOG_H
+#define SOCKET_SERVER_LOG_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+// asynchronous logging. every thread formats its records into a ring of
+// its own, and a background thread writes them out, so logging never takes
+// a lock on the thread that logs. the writer sleeps while every ring is
+// empty, the only syscall a record can cost is waking it up.
+
+enum class log_level : std::uint8_t
+{
+    trace,
+    debug,
+    info,
+    warning,
+    error,
+    off
+};
+
+inline constexpr std::array<std::string_view, 6> log_level_names = { "trace", "debug", "info", "warning", "error", "off" };
+
+// records below this level are compiled out
+#ifndef SOCKET_SERVER_LOG_LEVEL
+#define SOCKET_SERVER_LOG_LEVEL 0
+#endif
+
+inline constexpr log_level compiled_log_level = static_cast<log_level>(SOCKET_SERVER_LOG_LEVEL);
+
+class logger
+{
+public:
+    // a formatted line longer than this is truncated
+    static constexpr std::size_t record_size = 240;
+    // records per thread, a thread that runs ahead of the writer drops records
+    static constexpr std::size_t ring_size = 512;
+
+    static logger& instance()
+    {
+        static logger the_logger;
+        return the_logger;
+    }
+
+    log_level level() const noexcept
+    {
+        return m_level.load(std::memory_order_relaxed);
+    }
+
+    void level(log_level level) noexcept
+    {
+        m_level.store(level, std::memory_order_relaxed);
+    }
+
+    template<class... Args>
+    void write(log_level level, std::format_string<Args...> format, Args&&... args)
+    {
+        ring& the_ring = thread_ring();
+
+        auto head = the_ring.head.load(std::memory_order_relaxed);
+        auto tail = the_ring.tail.load(std::memory_order_acquire);
+        if (head - tail == ring_size)
+        {
+            the_ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        record& the_record = the_ring.records[head % ring_size];
+        the_record.time = std::chrono::system_clock::now();
+        the_record.level = level;
+        auto result = std::format_to_n(std::data(the_record.text), record_size, format, std::forward<Args>(args)...);
+        the_record.size = static_cast<std::uint16_t>(std::min<std::size_t>(result.size, record_size));
+
+        the_ring.head.store(head + 1, std::memory_order_release);
+
+        // a ring the writer had drained, it may be asleep. notify doesn't
+        // make a syscall unless it is.
+        if (head == tail)
+        {
+            m_wakeups.fetch_add(1, std::memory_order_release);
+            m_wakeups.notify_one();
+        }
+    }
+
+    logger(const logger&) = delete;
+    logger& operator=(const logger&) = delete;
+
+private:
+    struct record
+    {
+        std::chrono::system_clock::time_point time;
+        log_level level;
+        std::uint16_t size;
+        std::array<char, record_size> text;
+    };
+
+    // single producer, the thread it belongs to, and single consumer, the writer
+    struct ring
+    {
+        alignas(64) std::atomic<std::size_t> head{0};
+        alignas(64) std::atomic<std::size_t> tail{0};
+        std::atomic<std::uint64_t> dropped{0};
+        std::uint64_t dropped_reported = 0;
+        // the thread has exited, the ring goes away once it is drained
+        std::atomic<bool> closed{false};
+        std::array<record, ring_size> records;
+    };
+
+    logger() :
+        m_writer([this](std::stop_token stop) { run(stop); }) {}
+
+    ~logger()
+    {
+        m_writer.request_stop();
+        m_wakeups.fetch_add(1, std::memory_order_release);
+        m_wakeups.notify_one();
+        m_writer.join();
+    }
+
+    ring& thread_ring()
+    {
+        // closes the ring when its thread exits
+        struct holder
+        {
+            std::shared_ptr<ring> the_ring;
+
+            ~holder()
+            {
+                if (the_ring)
+                    the_ring->closed.store(true, std::memory_order_release);
+            }
+        };
+        thread_local holder this_thread;
+
+        if (!this_thread.the_ring)
+        {
+            this_thread.the_ring = std::make_shared<ring>();
+            std::lock_guard lock(m_mutex);
+            m_rings.push_back(this_thread.the_ring);
+        }
+
+        return *this_thread.the_ring;
+    }
+
+    void run(std::stop_token stop)
+    {
+        std::string output;
+        for (;;)
+        {
+            // read before the rings, a record published after drain looked
+            // at its ring bumps m_wakeups past this and the wait returns
+            auto wakeups = m_wakeups.load(std::memory_order_acquire);
+            if (stop.stop_requested())
+                break;
+            if (!drain(output))
+                m_wakeups.wait(wakeups, std::memory_order_acquire);
+        }
+
+        // what was logged up to the end
+        drain(output);
+    }
+
+    // writes out what every ring holds, returns false if there was nothing
+    bool drain(std::string& output)
+    {
+        std::vector<std::shared_ptr<ring>> rings;
+        {
+            std::lock_guard lock(m_mutex);
+            rings = m_rings;
+        }
+
+        output.clear();
+        for (auto& the_ring : rings)
+        {
+            auto tail = the_ring->tail.load(std::memory_order_relaxed);
+            auto head = the_ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail)
+                append(output, the_ring->records[tail % ring_size]);
+            the_ring->tail.store(tail, std::memory_order_release);
+
+            auto dropped = the_ring->dropped.load(std::memory_order_relaxed);
+            if (dropped != the_ring->dropped_reported)
+            {
+                std::format_to(std::back_inserter(output), "[warning] {} log records dropped\n", dropped - the_ring->dropped_reported);
+                the_ring->dropped_reported = dropped;
+            }
+        }
+
+        {
+            std::lock_guard lock(m_mutex);
+            std::erase_if(m_rings, [](const std::shared_ptr<ring>& the_ring)
+            {
+                return the_ring->closed.load(std::memory_order_acquire)
+                    && the_ring->tail.load(std::memory_order_relaxed) == the_ring->head.load(std::memory_order_acquire);
+            });
+        }
+
+        for (std::string_view rest = output; !rest.empty(); )
+        {
+            auto written = ::write(STDERR_FILENO, std::data(rest), std::size(rest));
+            if (written == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            rest.remove_prefix(written);
+        }
+
+        return !output.empty();
+    }
+
+    static void append(std::string& output, const record& the_record)
+    {
+        auto since_epoch = std::chrono::duration_cast<std::chrono::microseconds>(the_record.time.time_since_epoch()).count();
+        std::format_to(std::back_inserter(output), "{}.{:06} [{}] ", since_epoch / 1000000, since_epoch % 1000000,
+                       log_level_names[static_cast<std::size_t>(the_record.level)]);
+
+        std::string_view text(std::data(the_record.text), the_record.size);
+        output.append(text);
+        if (text.empty() || text.back() != '\n')
+            output.push_back('\n');
+    }
+
+    std::atomic<log_level> m_level{log_level::info};
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<ring>> m_rings;
+    // bumped whenever a ring stops being empty, the writer waits on it
+    std::atomic<std::uint32_t> m_wakeups{0};
+    // declared last, it starts running in the constructor
+    std::jthread m_writer;
+};
+
+// whether a record at level would be written. checked before doing any
+// work that only a record needs.
+template<log_level level>
+bool log_enabled()
+{
+    if constexpr (level < compiled_log_level)
+        return false;
+    else
+        return level >= logger::instance().level();
+}
+
+template<log_level level, class... Args>
+void log(std::format_string<Args...> format, Args&&... args)
+{
+    if constexpr (level >= compiled_log_level)
+        if (level >= logger::instance().level())
+            logger::instance().write(level, format, std::forward<Args>(args)...);
+}
+
+inline void log_error(const std::error_code& error)
+{
+    log<log_level::error>("{}:{},{}", error.category().name(), error.value(), error.message());
+}
+
+#endif
@@ -1,30 +1,43 @@
 #include <cerrno>
 #include <cstring>
+#include <cstdint>
 
 #include <string_view>
 #include <memory>
 #include <iostream>
 #include <vector>
 #include <expected>
-#include <map>
 #include <optional>
 #include <cassert>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <deque>
 
+#include <csignal>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 
-template<typename CharT, typename Traits>
-auto print_error_message(std::basic_ostream<CharT, Traits>& os, const std::error_code& error)
-{
-    os << error << ',' << error.message() << '\n';
-}
+#include "ThreadPool.h"
+#include "log.h"
+#include "timer_wheel.h"
 
 class file_descriptor : public std::optional<int>
 {
 public:
     using Base = std::optional<int>;
 
+    file_descriptor() = default;
+
     explicit file_descriptor(int fd) :
         Base(std::in_place, fd) {}
 
@@ -32,7 +45,7 @@ public:
     {
         if (Base::has_value())
             if (::close(Base::value()) == -1)
-                print_error_message(std::cerr, std::error_code(errno, std::system_category()));
+                log_error(std::error_code(errno, std::system_category()));
     }
 
     file_descriptor(const file_descriptor&) = delete;
@@ -43,250 +56,1202 @@ public:
         // a moved-from std::optional still contains a value, but the value itself is moved from.
         Base::swap(other);
     }
+
+    file_descriptor& operator=(file_descriptor&& other)
+    {
+        // the descriptor held so far is closed when previous goes out of scope
+        file_descriptor previous(std::move(*this));
+        Base::swap(other);
+        return *this;
+    }
 };
 
+// fixed size buffers recycled by one reactor. a connection only holds
+// buffers while output is waiting for it, an idle one holds none.
+class buffer_pool
+{
+public:
+    static constexpr std::size_t buffer_size = 1024 * 16;
+    // buffers kept for reuse, the rest go back to the heap
+    static constexpr std::size_t max_free = 1024;
+
+    struct buffer
+    {
+        std::array<char, buffer_size> data;
+        // the bytes [begin, end) are waiting to be sent
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+
+    using pointer = std::unique_ptr<buffer>;
+
+    pointer acquire()
+    {
+        if (m_free.empty())
+            // default initialised, the data isn't cleared
+            return pointer(new buffer);
+
+        pointer result = std::move(m_free.back());
+        m_free.pop_back();
+        result->begin = result->end = 0;
+        return result;
+    }
+
+    void release(pointer released)
+    {
+        if (std::size(m_free) < max_free)
+            m_free.push_back(std::move(released));
+    }
+
+private:
+    std::vector<pointer> m_free;
+};
+
+// how long a connection may stay in each state, zero for no limit
+struct connection_timeouts
+{
+    // nothing received or sent, this also ends connections that never send
+    std::chrono::milliseconds idle{60000};
+    // output is queued and the peer doesn't read it
+    std::chrono::milliseconds write{30000};
+    // our side is shut down and the peer doesn't close its side
+    std::chrono::milliseconds close{5000};
+};
+
+// turns a request into its response. the default one echoes the request.
+using request_handler = std::function<std::string(std::string_view)>;
+
 class epoll
 {
+public:
+    // what a registered descriptor is, so dispatch needs no syscall to tell
+    enum class kind : std::uint8_t
+    {
+        free,
+        listener,
+        client,
+        wakeup
+    };
+
+    // what zero-copy mode keeps per connection, allocated on first use
+    struct zero_copy_state
+    {
+        // socket to pipe to socket, for passing input through untouched
+        file_descriptor pipe_read;
+        file_descriptor pipe_write;
+        // bytes in the pipe that the socket hasn't taken yet
+        std::size_t piped = 0;
+        // MSG_ZEROCOPY sends as the kernel counts them, and the responses
+        // they send from, kept until the kernel reports them done
+        std::uint32_t sends = 0;
+        std::deque<std::pair<std::uint32_t, std::string>> in_flight;
+        // hung up, waiting for the last completions before it is erased
+        bool lingering = false;
+    };
+
+    struct connection
+    {
+        file_descriptor fd;
+        // bumped whenever the slot is freed, so events and responses meant
+        // for a closed descriptor don't reach one that reuses its number
+        std::uint32_t generation = 0;
+        kind type = kind::free;
+        // the peer has shut down its side, ours follows once output is sent
+        bool read_closed = false;
+        bool write_closed = false;
+        // a request is on the pool. the next one waits in input until its
+        // response is back, so responses keep the order of their requests
+        bool busy = false;
+        // output or input reached max_queued, reading waits until both are
+        // down to half
+        bool paused = false;
+        // what the socket didn't take yet, sent with EPOLLOUT
+        std::vector<buffer_pool::pointer> output;
+        std::vector<buffer_pool::pointer> input;
+        std::unique_ptr<zero_copy_state> zero_copy;
+    };
+
+    // MSG_ZEROCOPY costs page pinning and a completion, below this copying is cheaper
+    static constexpr std::size_t zero_copy_threshold = 1024 * 16;
+    // bytes spliced into a pipe per call, the default pipe capacity
+    static constexpr std::size_t pipe_size = 1024 * 64;
+
 private:
-    epoll(int epfd) :
-        m_epfd(epfd) {}
+    epoll(int epfd, bool edge_triggered, bool zero_copy) :
+        m_epfd(epfd), m_edge_triggered(edge_triggered), m_zero_copy(zero_copy), m_receive(m_buffers.acquire()) {}
+
+    // requests handed to a ThreadPool come back through here. the reactor
+    // sends the responses itself, so only its own thread touches its sockets.
+    // shared with the tasks in flight, which may outlive the reactor.
+    struct handoff
+    {
+        ThreadPool& pool;
+        request_handler handler;
+        file_descriptor wakeup;
+        std::mutex mutex;
+        std::vector<std::pair<std::uint64_t, std::string>> responses;
+    };
 
     file_descriptor m_epfd;
-    std::map<file_descriptor, void*, std::less<file_descriptor::Base>> m_fds;
+    // EPOLLET on every descriptor, and non-blocking sockets
+    bool m_edge_triggered;
+    // splice input that passes through unchanged, MSG_ZEROCOPY for large
+    // responses. needs non-blocking sockets, in either trigger mode.
+    bool m_zero_copy;
+    // indexed by descriptor number, the kernel hands out the lowest free
+    // number, so the table stays dense
+    std::vector<connection> m_connections;
+    request_handler m_handler;
+    std::shared_ptr<handoff> m_handoff;
+    // reverse lookups for the accept log, numeric addresses otherwise
+    bool m_resolve_names = true;
+    // one timer per client, indexed by descriptor like m_connections
+    timer_wheel m_timers;
+    connection_timeouts m_timeouts;
+    // when the last epoll_wait returned, deadlines count from here
+    timer_wheel::clock::time_point m_time = timer_wheel::clock::now();
+    // bytes a connection may have queued in output or input before it
+    // stops receiving
+    std::size_t m_max_queued = 1024 * 1024;
+    buffer_pool m_buffers;
+    // every recv of this reactor lands here, requests are handled before the next one
+    buffer_pool::pointer m_receive;
 
-public:
-    using iterator = typename decltype(m_fds)::iterator;
-    using key_type = typename decltype(m_fds)::key_type;
-    using mapped_type = typename decltype(m_fds)::mapped_type;
+    // what epoll_data carries: the descriptor in the low half and the
+    // generation of its slot in the high half
+    static std::uint64_t token(int fd, std::uint32_t generation)
+    {
+        return std::uint64_t(generation) << 32 | static_cast<std::uint32_t>(fd);
+    }
 
-    static std::expected<epoll, std::error_code> create()
+public:
+    static std::expected<epoll, std::error_code> create(bool edge_triggered = false, bool zero_copy = false)
     {
         int epfd = ::epoll_create1(0);
         if (epfd == -1) {
             return std::unexpected(std::error_code(errno, std::system_category()));
         }
 
-        return epoll(epfd);
+        return epoll(epfd, edge_triggered, zero_copy);
     }
 
-    auto erase(iterator it)
+    // the slot a token refers to, or nullptr once its descriptor was closed,
+    // even if the number has been handed out again since
+    connection* find(std::uint64_t token)
     {
-        if (::epoll_ctl(*m_epfd, EPOLL_CTL_DEL, *it->first, nullptr) == -1)
-            print_error_message(std::cerr, std::error_code(errno, std::system_category()));
+        auto fd = static_cast<std::uint32_t>(token);
+        if (fd >= std::size(m_connections))
+            return nullptr;
+
+        connection& slot = m_connections[fd];
+        if (slot.type == kind::free || slot.generation != token >> 32)
+            return nullptr;
 
-        // The iterator pos must be valid and dereferenceable.
-        // return iterator following the last removed element.
-        return m_fds.erase(it);
+        return &slot;
     }
 
-    auto try_emplace(uint32_t event_flag, file_descriptor fd, mapped_type mapped)
+    void erase(connection& slot)
     {
-        auto it_inserted = m_fds.try_emplace(std::move(fd), std::move(mapped));
-        if (!it_inserted.second)
-        {
-            std::cerr << "m_fds.try_emplace Number of fd inserted: 0\n";
+        if (::epoll_ctl(*m_epfd, EPOLL_CTL_DEL, *slot.fd, nullptr) == -1)
+            log_error(std::error_code(errno, std::system_category()));
 
-            return it_inserted;
+        m_timers.cancel(*slot.fd);
+
+        release(slot.output);
+        release(slot.input);
+
+        // closing would go on sending from MSG_ZEROCOPY responses freed
+        // here, reset the connection instead
+        if (slot.zero_copy && !slot.zero_copy->in_flight.empty())
+        {
+            ::linger abort = { .l_onoff = 1, .l_linger = 0 };
+            if (::setsockopt(*slot.fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort)) == -1)
+                log_error(std::error_code(errno, std::system_category()));
         }
-        
-        static_assert(sizeof(it_inserted.first) == sizeof(epoll_data_t));
+        slot.zero_copy.reset();
+
+        slot.fd = file_descriptor();
+        slot.type = kind::free;
+        slot.read_closed = false;
+        slot.write_closed = false;
+        slot.busy = false;
+        slot.paused = false;
+        ++slot.generation;
+    }
+
+    connection* try_emplace(kind type, uint32_t event_flag, file_descriptor fd)
+    {
+        int number = *fd;
+        if (static_cast<std::size_t>(number) >= std::size(m_connections))
+            m_connections.resize(number + 1);
+
+        // an open descriptor number is never handed out twice
+        connection& slot = m_connections[number];
+        assert(slot.type == kind::free);
+
+        slot.fd = std::move(fd);
+        slot.type = type;
+
         struct epoll_event event = {
-            .events = event_flag,
-            .data = { .ptr = *reinterpret_cast<void**>(&it_inserted.first) }
+            .events = event_flag | (m_edge_triggered ? EPOLLET : 0u),
+            .data = { .u64 = token(number, slot.generation) }
         };
 
-        if (::epoll_ctl(*m_epfd, EPOLL_CTL_ADD, *fd, &event) == -1)
+        if (::epoll_ctl(*m_epfd, EPOLL_CTL_ADD, number, &event) == -1)
         {
-            print_error_message(std::cerr, std::error_code(errno, std::system_category()));
-            // std::println(std::cerr, "epoll_ctl: {}.", std::strerror(errno));
+            log_error(std::error_code(errno, std::system_category()));
 
-            it_inserted.first = erase(it_inserted.first);
-            it_inserted.second = false;
+            slot.fd = file_descriptor();
+            slot.type = kind::free;
+            ++slot.generation;
+            return nullptr;
         }
 
-        return it_inserted;
+        return &slot;
+    }
+
+    void handle(request_handler handler)
+    {
+        m_handler = std::move(handler);
+    }
+
+    void resolve_names(bool enable)
+    {
+        m_resolve_names = enable;
+    }
+
+    void timeouts(const connection_timeouts& timeouts)
+    {
+        m_timeouts = timeouts;
+    }
+
+    void max_queued(std::size_t bytes)
+    {
+        m_max_queued = bytes;
+    }
+
+    // runs the handler on pool instead of the reactor thread
+    std::expected<bool, std::error_code> offload(ThreadPool& pool)
+    {
+        file_descriptor wakeup(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        if (*wakeup == -1)
+            return std::unexpected(std::error_code(errno, std::system_category()));
+
+        // the pool's tasks signal through their own descriptor of the same eventfd
+        m_handoff = std::make_shared<handoff>(pool, m_handler, file_descriptor(::dup(*wakeup)));
+        if (!try_emplace(kind::wakeup, EPOLLIN, std::move(wakeup)))
+            return std::unexpected(std::error_code(EINVAL, std::system_category()));
+
+        return true;
     }
 
     std::expected<bool, std::error_code> listen(const char *__restrict name,
 			                                    const char *__restrict service,
 			                                    const struct addrinfo *__restrict req,
-                                                int backlog)
+                                                int backlog,
+                                                bool reuse_port = false)
     {
         std::unique_ptr<addrinfo, decltype(&::freeaddrinfo)> result(nullptr, ::freeaddrinfo);
 
         // getaddrinfo() returns 0 if it succeeds, or the nonzero error codes
         if (int status = ::getaddrinfo(name, service, req, std::out_ptr(result)))
         {
-            std::println(std::cerr, "getaddrinfo: {}", ::gai_strerror(status)); // !
+            log<log_level::error>("getaddrinfo: {}", ::gai_strerror(status)); // !
             return std::unexpected(std::error_code(status, std::system_category())); // !
         }
 
+        // why the last address failed, reported if none of them worked
+        std::error_code error(EADDRNOTAVAIL, std::system_category());
+        bool listening = false;
+
         for (auto result_ptr = result.get(); result_ptr; result_ptr = result_ptr->ai_next)
         {
             // ai_family: AF_INET is 2, AF_INET6 is 10
             file_descriptor listen_fd(::socket(result_ptr->ai_family,
-                                               result_ptr->ai_socktype,
+                                               result_ptr->ai_socktype | (m_edge_triggered ? SOCK_NONBLOCK : 0),
                                                result_ptr->ai_protocol));
             if (*listen_fd == -1)
             {
-                print_error_message(std::cerr, std::error_code(errno, std::system_category()));
+                error = std::error_code(errno, std::system_category());
+                log_error(error);
+                continue;
+            }
+
+            // every reactor binds its own listener to the same address,
+            // the kernel spreads incoming connections across them
+            int enable = 1;
+            if (reuse_port && ::setsockopt(*listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+            {
+                error = std::error_code(errno, std::system_category());
+                log_error(error);
                 continue;
             }
 
             if (::bind(*listen_fd, result_ptr->ai_addr,
                                    result_ptr->ai_addrlen) == -1)
             {
-                print_error_message(std::cerr, std::error_code(errno, std::system_category()));
+                error = std::error_code(errno, std::system_category());
+                log_error(error);
                 continue;
             }
 
             if (::listen(*listen_fd, backlog) == -1)
             {
-                print_error_message(std::cerr, std::error_code(errno, std::system_category()));
+                error = std::error_code(errno, std::system_category());
+                log_error(error);
                 continue;
             }
 
             // Transfer ownership of listen_fd to the try_emplace function.
-            try_emplace(EPOLLIN, std::move(listen_fd), {});
+            if (try_emplace(kind::listener, EPOLLIN, std::move(listen_fd)))
+                listening = true;
+            else
+                error = std::error_code(EINVAL, std::system_category());
 
             // listen_fd is now empty after the ownership has been moved
             assert(!listen_fd.has_value());
         }
 
+        // a reactor without a listener would wait for nothing
+        if (!listening)
+            return std::unexpected(error);
+
         return true;
     }
 
     std::expected<bool, std::error_code> wait(std::vector<struct epoll_event>& events, int timeout)
     {
+        // wake up for the next deadline, or after timeout without one
+        timeout = m_timers.timeout(timer_wheel::clock::now(), timeout);
+
         int events_size = ::epoll_wait(*m_epfd, std::data(events), std::size(events), timeout);
+        m_time = timer_wheel::clock::now();
         if (events_size == -1)
             return std::unexpected(std::error_code(errno, std::system_category()));
 
         for (int events_index = 0; events_index < events_size; events_index++)
         {
-            // warning: taking address of packed member of 'epoll_event' may result in an unaligned pointer value
-            iterator it = *reinterpret_cast<iterator*>(&events[events_index].data.ptr);
+            auto token = events[events_index].data.u64;
+            connection* slot = find(token);
+            // closed by an earlier event of this batch
+            if (!slot)
+                continue;
 
             auto event_flag = events[events_index].events;
-            auto socket_fd = *it->first;
+            auto socket_fd = *slot->fd;
 
-            std::println(std::clog, "event_flag: {}", event_flag);
+            log<log_level::trace>("event_flag: {}", event_flag);
 
             if (event_flag & EPOLLERR)
             {
-                std::println(std::cerr, "EPOLLERR, fd: {}", socket_fd);
-                continue;
+                // MSG_ZEROCOPY completions come through the error queue, which raises EPOLLERR too
+                if (slot->zero_copy)
+                    reap_completions(*slot);
+
+                int error = 0;
+                socklen_t error_size = sizeof(error);
+                if (::getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &error_size) == -1)
+                    error = errno;
+                if (error)
+                {
+                    log<log_level::warning>("EPOLLERR, fd: {}, {}", socket_fd, std::strerror(error));
+                    if (slot->type == kind::client)
+                        erase(*slot);
+                    continue;
+                }
             }
 
             if (event_flag & EPOLLHUP)
             {
-                erase(it);
+                // the kernel may still send from responses it hasn't reported done
+                if (slot->zero_copy && !slot->zero_copy->in_flight.empty())
+                {
+                    if (!slot->zero_copy->lingering)
+                        linger(*slot);
+                    continue;
+                }
+
+                erase(*slot);
                 continue;
             }
 
-            if (event_flag & EPOLLRDHUP)
+            if (slot->type == kind::wakeup)
             {
-                if (::shutdown(socket_fd, SHUT_WR) == -1)
-                    print_error_message(std::cerr, std::error_code(errno, std::system_category()));
+                send_responses();
+                continue;
             }
 
-            int is_listen;
-            socklen_t len = sizeof(is_listen);
-            if (::getsockopt(socket_fd, SOL_SOCKET, SO_ACCEPTCONN, &is_listen, &len) == -1)
+            if (slot->type == kind::listener) // listen socket
             {
-                print_error_message(std::cerr, std::error_code(errno, std::system_category()));
+                accept_connections(socket_fd);
                 continue;
             }
 
-            if (is_listen) // listen socket
-            {
-                sockaddr_storage addr_storage;
-                sockaddr& addr = reinterpret_cast<sockaddr&>(addr_storage);
-                socklen_t addr_len = sizeof(sockaddr_storage);
+            // accept socket
+            if (event_flag & EPOLLOUT)
+                flush(*slot);
 
-                file_descriptor accept_fd(::accept(socket_fd, &addr, &addr_len));
-                if (accept_fd == -1)
-                {
-                    std::cerr << std::error_code(errno, std::system_category());
-                    // std::println(std::cerr, "accept: {}", std::strerror(errno));
+            if (event_flag & EPOLLIN)
+                receive_requests(*slot, token);
+
+            finish(*slot);
+        }
+
+        m_timers.advance(m_time, [this](std::uint32_t fd) { expire(m_connections[fd]); });
+
+        return true;
+    }
+
+private:
+    // one connection per event, or in edge triggered mode every connection
+    // waiting in the backlog, since no new event comes for those already there
+    void accept_connections(int listen_fd)
+    {
+        do
+        {
+            sockaddr_storage addr_storage;
+            sockaddr& addr = reinterpret_cast<sockaddr&>(addr_storage);
+            socklen_t addr_len = sizeof(sockaddr_storage);
+
+            int accepted = ::accept4(listen_fd, &addr, &addr_len, m_edge_triggered || m_zero_copy ? SOCK_NONBLOCK : 0);
+            if (accepted == -1)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
                     continue;
-                }
 
-                std::array<char, 1024> receive_host;
-                std::array<char, 1024> receive_port;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_error(std::error_code(errno, std::system_category()));
+                return;
+            }
+
+            file_descriptor accept_fd(accepted);
+
+            // print host and port, resolving them only if the record is written
+            if (log_enabled<log_level::debug>())
+            {
+                std::array<char, NI_MAXHOST> receive_host;
+                std::array<char, NI_MAXSERV> receive_port;
                 if (int status = ::getnameinfo(&addr, addr_len,
                                                std::data(receive_host), std::size(receive_host),
-                                               std::data(receive_port), std::size(receive_port), 0))
-                {
-                    std::println(std::cerr, "getnameinfo: {}", gai_strerror(status));
+                                               std::data(receive_port), std::size(receive_port),
+                                               m_resolve_names ? 0 : NI_NUMERICHOST | NI_NUMERICSERV))
+                    log<log_level::debug>("getnameinfo: {}", gai_strerror(status));
+                else
+                    log<log_level::debug>("accept from {}:{}", std::data(receive_host), std::data(receive_port));
+            }
+
+            // lets sends ask for MSG_ZEROCOPY, a kernel without it copies as before
+            int enable = 1;
+            if (m_zero_copy && ::setsockopt(*accept_fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == -1)
+                log<log_level::debug>("SO_ZEROCOPY: {}", std::strerror(errno));
+
+            if (connection* slot = try_emplace(kind::client, EPOLLIN | EPOLLRDHUP, std::move(accept_fd)))
+                arm_timer(*slot);
+        }
+        while (m_edge_triggered);
+    }
+
+    // one recv per event, or in edge triggered mode recv until EAGAIN
+    void receive_requests(connection& slot, std::uint64_t token)
+    {
+        // nothing looks at the bytes, they go back without passing through user space
+        if (m_zero_copy && !m_handler && !m_handoff && pass_through(slot))
+            return;
+
+        auto& buffer = m_receive->data;
+
+        do
+        {
+            auto receive_size = ::recv(*slot.fd, std::data(buffer), std::size(buffer), 0);
+            if (receive_size == -1)
+            {
+                if (errno == EINTR)
                     continue;
-                }
 
-                // print host and port
-                std::println(std::clog, "accept from {}:{}", std::data(receive_host), std::data(receive_port));
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_error(std::error_code(errno, std::system_category()));
+                return;
+            }
 
-                try_emplace(EPOLLIN | EPOLLRDHUP, std::move(accept_fd), {});
+            if (receive_size == 0)
+            {
+                log<log_level::trace>("receive_size: 0");
+                slot.read_closed = true;
+                watch(slot, pending_output(slot));
+                return;
             }
-            else // accept socket
+
+            // traffic, unless a write deadline is running, which only the peer reading ends
+            if (!pending_output(slot))
+                arm_timer(slot);
+
+            std::string_view receive{std::data(buffer), static_cast<std::size_t>(receive_size)};
+            log<log_level::trace>("receive_size: {}, {}", receive_size, receive);
+
+            if (m_handoff && slot.busy)
+                append(slot.input, receive);
+            else if (m_handoff)
+                post(slot, token, std::string(receive));
+            else if (m_handler)
+                send_response(slot, m_handler(receive));
+            else
+                send_response(slot, receive);
+
+            // a peer that sends but doesn't read, or outruns the pool
+            if (throttle(slot))
+                return;
+        }
+        while (m_edge_triggered);
+    }
+
+    // splices from the socket into the connection's pipe and from the pipe
+    // back into the socket. while the socket doesn't take what the pipe holds,
+    // reading stops, that is the backpressure the copying path gets from its
+    // output queue. false if there is no pipe, the caller copies instead.
+    bool pass_through(connection& slot)
+    {
+        zero_copy_state& state = zero_copy(slot);
+        if (!state.pipe_read)
+        {
+            int pipe_fds[2];
+            if (::pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1)
             {
-                std::array<char, 1024 * 16> buffer;
+                log_error(std::error_code(errno, std::system_category()));
+                return false;
+            }
+            state.pipe_read = file_descriptor(pipe_fds[0]);
+            state.pipe_write = file_descriptor(pipe_fds[1]);
+        }
 
-                auto receive_size = ::recv(socket_fd, std::data(buffer), std::size(buffer), 0);
-                if (receive_size == -1)
-                {
-                    print_error_message(std::cerr, std::error_code(errno, std::system_category()));
+        do
+        {
+            auto moved = ::splice(*slot.fd, nullptr, *state.pipe_write, nullptr, pipe_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved == -1)
+            {
+                if (errno == EINTR)
                     continue;
-                }
 
-                if (receive_size == 0)
-                {
-                    std::println(std::clog, "receive_size: 0");
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_error(std::error_code(errno, std::system_category()));
+                return true;
+            }
+
+            if (moved == 0)
+            {
+                log<log_level::trace>("receive_size: 0");
+                slot.read_closed = true;
+                watch(slot, pending_output(slot));
+                return true;
+            }
+
+            log<log_level::trace>("spliced: {}", moved);
+            state.piped += moved;
+            arm_timer(slot);
+
+            if (!drain_pipe(slot))
+            {
+                watch(slot, true);
+                return true;
+            }
+        }
+        while (m_edge_triggered);
+
+        return true;
+    }
+
+    // splices what the pipe holds into the socket, true once it is empty
+    bool drain_pipe(connection& slot)
+    {
+        zero_copy_state& state = *slot.zero_copy;
+        while (state.piped)
+        {
+            auto moved = ::splice(*state.pipe_read, nullptr, *slot.fd, nullptr, state.piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved == -1)
+            {
+                if (errno == EINTR)
                     continue;
+
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_error(std::error_code(errno, std::system_category()));
+                return false;
+            }
+
+            state.piped -= moved;
+            arm_timer(slot);
+        }
+        return true;
+    }
+
+    zero_copy_state& zero_copy(connection& slot)
+    {
+        if (!slot.zero_copy)
+            slot.zero_copy = std::make_unique<zero_copy_state>();
+        return *slot.zero_copy;
+    }
+
+    // keeps a hung up connection until its MSG_ZEROCOPY completions are in.
+    // edge triggered with no events, EPOLLHUP is reported once and EPOLLERR
+    // for every completion, which reaps them and erases the connection once
+    // none are left. the close timeout bounds the wait.
+    void linger(connection& slot)
+    {
+        slot.zero_copy->lingering = true;
+
+        int number = *slot.fd;
+        struct epoll_event event = {
+            .events = EPOLLET,
+            .data = { .u64 = token(number, slot.generation) }
+        };
+        if (::epoll_ctl(*m_epfd, EPOLL_CTL_MOD, number, &event) == -1)
+            log_error(std::error_code(errno, std::system_category()));
+
+        // hung up without an error, our side is shut down and this is the close timeout
+        arm_timer(slot);
+    }
+
+    // queued buffers or spliced bytes the socket hasn't taken yet
+    static bool pending_output(const connection& slot)
+    {
+        return !slot.output.empty() || (slot.zero_copy && slot.zero_copy->piped);
+    }
+
+    // bytes waiting in a queue of buffers
+    static std::size_t queued(const std::vector<buffer_pool::pointer>& queue)
+    {
+        std::size_t size = 0;
+        for (auto& buffer : queue)
+            size += buffer->end - buffer->begin;
+        return size;
+    }
+
+    // stops receiving once output or input holds max_queued bytes, true if
+    // it did. otherwise nothing but the write timeout bounds what a peer
+    // that never reads makes us keep.
+    bool throttle(connection& slot)
+    {
+        if (queued(slot.output) < m_max_queued && queued(slot.input) < m_max_queued)
+            return false;
+
+        slot.paused = true;
+        watch(slot, pending_output(slot));
+        return true;
+    }
+
+    // receives again once output and input are down to half. re-arming
+    // EPOLLIN reports a socket that is readable already, edge triggered too.
+    void resume(connection& slot)
+    {
+        if (!slot.paused || queued(slot.output) > m_max_queued / 2 || queued(slot.input) > m_max_queued / 2)
+            return;
+
+        slot.paused = false;
+        watch(slot, pending_output(slot));
+    }
+
+    // the events a client is registered for, EPOLLOUT only while output waits.
+    // EPOLLIN and EPOLLRDHUP go once the peer has shut down, while the pipe
+    // of pass_through is full, level triggered they would fire nonstop, and
+    // while the connection is paused.
+    void watch(connection& slot, bool writable)
+    {
+        bool readable = !slot.read_closed && !slot.paused && !(slot.zero_copy && slot.zero_copy->piped);
+
+        int number = *slot.fd;
+        struct epoll_event event = {
+            .events = (readable ? EPOLLIN | EPOLLRDHUP : 0u) | (writable ? EPOLLOUT : 0u) | (m_edge_triggered ? EPOLLET : 0u),
+            .data = { .u64 = token(number, slot.generation) }
+        };
+
+        if (::epoll_ctl(*m_epfd, EPOLL_CTL_MOD, number, &event) == -1)
+            log_error(std::error_code(errno, std::system_category()));
+    }
+
+    // sends what the socket takes right away, queues the rest for EPOLLOUT.
+    // never blocks, not even on the blocking sockets of level triggered mode.
+    void send_response(connection& slot, std::string_view response)
+    {
+        if (slot.output.empty())
+        {
+            auto sent = ::send(*slot.fd, std::data(response), std::size(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent == -1)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    log_error(std::error_code(errno, std::system_category()));
+                    return;
                 }
+                sent = 0;
+            }
+
+            response.remove_prefix(sent);
+            if (response.empty())
+                return;
+
+            watch(slot, true);
+            append(slot.output, response);
+            arm_timer(slot);
+            return;
+        }
+
+        append(slot.output, response);
+    }
+
+    // a response that can be handed over sends large ones with MSG_ZEROCOPY.
+    // the string is kept until the error queue reports the kernel is done
+    // with its pages.
+    void send_response(connection& slot, std::string&& response)
+    {
+        if (!m_zero_copy || std::size(response) < zero_copy_threshold || !slot.output.empty())
+        {
+            send_response(slot, std::string_view(response));
+            return;
+        }
+
+        auto sent = ::send(*slot.fd, std::data(response), std::size(response), MSG_DONTWAIT | MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (sent == -1)
+        {
+            // ENOBUFS: over the optmem limit for pinned pages, copy instead
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                send_response(slot, std::string_view(response));
+            else
+                log_error(std::error_code(errno, std::system_category()));
+            return;
+        }
+
+        zero_copy_state& state = zero_copy(slot);
+        auto& kept = state.in_flight.emplace_back(state.sends++, std::move(response)).second;
+
+        // the rest is copied, it goes out later through flush
+        std::string_view rest = kept;
+        rest.remove_prefix(sent);
+        if (rest.empty())
+            return;
+
+        watch(slot, true);
+        append(slot.output, rest);
+        arm_timer(slot);
+    }
+
+    // reads MSG_ZEROCOPY completions, ranges of send numbers the kernel no
+    // longer needs the buffers of, and drops those responses
+    void reap_completions(connection& slot)
+    {
+        zero_copy_state& state = *slot.zero_copy;
+        for (;;)
+        {
+            std::array<char, 128> control;
+            msghdr message = {};
+            message.msg_control = std::data(control);
+            message.msg_controllen = std::size(control);
+
+            if (::recvmsg(*slot.fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_error(std::error_code(errno, std::system_category()));
+                return;
+            }
+
+            for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+            {
+                if (!(header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR)
+                    && !(header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR))
+                    continue;
+
+                sock_extended_err error;
+                std::memcpy(&error, CMSG_DATA(header), sizeof(error));
+                if (error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                    continue;
 
-                std::string_view receive{std::data(buffer), static_cast<std::size_t>(receive_size)};
-                std::print(std::clog, "receive_size: {}, {}", receive_size, receive);
+                // loopback and devices without scatter-gather copy after all
+                if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                    log<log_level::trace>("fd {}: sends {}-{} were copied", *slot.fd, error.ee_info, error.ee_data);
 
-                if (receive_size != ::send(socket_fd, std::data(buffer), receive_size, 0))
-                    std::println(std::cerr, "Error sending response");
+                while (!state.in_flight.empty()
+                       && static_cast<std::int32_t>(error.ee_data - state.in_flight.front().first) >= 0)
+                    state.in_flight.pop_front();
             }
         }
+    }
 
-        return true;
+    // queues data behind whatever is queued already, filling up the last buffer first
+    void append(std::vector<buffer_pool::pointer>& queue, std::string_view data)
+    {
+        while (!data.empty())
+        {
+            if (queue.empty() || queue.back()->end == buffer_pool::buffer_size)
+                queue.push_back(m_buffers.acquire());
+
+            auto& buffer = *queue.back();
+            auto size = std::min(std::size(data), buffer_pool::buffer_size - buffer.end);
+            std::copy_n(std::data(data), size, std::data(buffer.data) + buffer.end);
+            buffer.end += size;
+            data.remove_prefix(size);
+        }
+    }
+
+    void release(std::vector<buffer_pool::pointer>& queue)
+    {
+        for (auto& buffer : queue)
+            m_buffers.release(std::move(buffer));
+        queue.clear();
+    }
+
+    // runs the handler for a request on the pool, the response comes back
+    // through send_responses
+    void post(connection& slot, std::uint64_t token, std::string request)
+    {
+        slot.busy = true;
+        m_handoff->pool.post([handoff = m_handoff, token, request = std::move(request)]
+        {
+            auto response = handoff->handler ? handoff->handler(request) : request;
+            {
+                std::lock_guard lock(handoff->mutex);
+                handoff->responses.emplace_back(token, std::move(response));
+            }
+            if (::eventfd_write(*handoff->wakeup, 1) == -1)
+                log_error(std::error_code(errno, std::system_category()));
+        });
+    }
+
+    // sends the queued buffers with one sendmsg per batch, the socket
+    // counterpart of writev that takes MSG_DONTWAIT and MSG_NOSIGNAL
+    void flush(connection& slot)
+    {
+        // pass_through stopped reading until the pipe is empty
+        if (slot.zero_copy && slot.zero_copy->piped && !drain_pipe(slot))
+            return;
+
+        while (!slot.output.empty())
+        {
+            std::array<iovec, 64> vectors;
+            std::size_t count = 0;
+            for (auto& buffer : slot.output)
+            {
+                if (count == std::size(vectors))
+                    break;
+                vectors[count++] = { std::data(buffer->data) + buffer->begin, buffer->end - buffer->begin };
+            }
+
+            msghdr message = {};
+            message.msg_iov = std::data(vectors);
+            message.msg_iovlen = count;
+
+            auto sent = ::sendmsg(*slot.fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                // EAGAIN leaves EPOLLOUT armed for the rest
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_error(std::error_code(errno, std::system_category()));
+                return;
+            }
+
+            // hand the buffers that went out completely back to the pool
+            std::size_t drained = 0;
+            for (auto remaining = static_cast<std::size_t>(sent); remaining; )
+            {
+                auto& buffer = *slot.output[drained];
+                auto size = std::min(remaining, buffer.end - buffer.begin);
+                buffer.begin += size;
+                remaining -= size;
+                if (buffer.begin != buffer.end)
+                    break;
+
+                m_buffers.release(std::move(slot.output[drained++]));
+            }
+            slot.output.erase(std::begin(slot.output), std::begin(slot.output) + drained);
+
+            // the peer reads, the write deadline starts over
+            arm_timer(slot);
+            resume(slot);
+        }
+
+        watch(slot, false);
+        finish(slot);
+    }
+
+    // shuts down our side once the peer has shut down its side and every
+    // response to it is out
+    void finish(connection& slot)
+    {
+        if (!slot.read_closed || pending_output(slot) || slot.busy || slot.write_closed)
+            return;
+
+        if (::shutdown(*slot.fd, SHUT_WR) == -1 && errno != ENOTCONN)
+            log_error(std::error_code(errno, std::system_category()));
+
+        slot.write_closed = true;
+        arm_timer(slot);
+    }
+
+    // arms the deadline for the state the connection is in: closing,
+    // waiting for the peer to read, or idle
+    void arm_timer(connection& slot)
+    {
+        auto timeout = slot.write_closed ? m_timeouts.close
+                     : pending_output(slot) ? m_timeouts.write
+                     : m_timeouts.idle;
+
+        if (timeout.count() == 0)
+            m_timers.cancel(*slot.fd);
+        else
+            m_timers.arm(*slot.fd, m_time + timeout);
+    }
+
+    void expire(connection& slot)
+    {
+        if (slot.type != kind::client)
+            return;
+
+        // the pool is still working on its request, that isn't idle
+        if (slot.busy)
+        {
+            arm_timer(slot);
+            return;
+        }
+
+        log<log_level::debug>("fd {} timed out", *slot.fd);
+        erase(slot);
+    }
+
+    // sends what the pool has finished, to the connections still open
+    void send_responses()
+    {
+        eventfd_t count;
+        if (::eventfd_read(*m_handoff->wakeup, &count) == -1 && errno != EAGAIN)
+            log_error(std::error_code(errno, std::system_category()));
+
+        std::vector<std::pair<std::uint64_t, std::string>> responses;
+        {
+            std::lock_guard lock(m_handoff->mutex);
+            responses.swap(m_handoff->responses);
+        }
+
+        for (auto& [token, response] : responses)
+            if (connection* slot = find(token))
+            {
+                slot->busy = false;
+                send_response(*slot, std::move(response));
+
+                // everything received meanwhile goes out as the next request
+                if (!slot->input.empty())
+                {
+                    std::string request;
+                    for (auto& buffer : slot->input)
+                        request.append(std::data(buffer->data) + buffer->begin, buffer->end - buffer->begin);
+                    release(slot->input);
+                    post(*slot, token, std::move(request));
+                }
+
+                resume(*slot);
+                finish(*slot);
+            }
     }
 };
 
-int main(int argc, char* argv[])
+struct server_options
+{
+    const char* hostname = "localhost";
+    const char* port = "8080";
+    unsigned reactors = std::max(1u, std::thread::hardware_concurrency());
+    // pin reactor i to cpu i
+    bool pin = false;
+    // EPOLLET with non-blocking sockets, draining accepts and reads per event
+    bool edge_triggered = false;
+    // splice echoed bytes, MSG_ZEROCOPY for large handler responses
+    bool zero_copy = false;
+    // reverse lookups of peer addresses for the accept log
+    bool resolve_names = true;
+    connection_timeouts timeouts;
+    // bytes a connection may have waiting to be sent, or waiting for the
+    // pool, before it stops receiving
+    std::size_t max_queued = 1024 * 1024;
+    int backlog = 16;
+    int max_events = 16;
+    int timeout = 1000;
+    // run the handler on this pool instead of the reactor threads
+    ThreadPool* pool = nullptr;
+    request_handler handler;
+};
+
+static void pin_reactor(unsigned index)
 {
-    auto the_epoll = epoll::create();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &set);
+
+    // a cpu outside of the process' affinity leaves the reactor unpinned
+    if (int error = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set))
+        log_error(std::error_code(error, std::system_category()));
+}
+
+// one reactor: its own epoll instance and its own SO_REUSEPORT listener,
+// so reactors share nothing and scale with the number of cores
+static void run_reactor(std::stop_token stop, const server_options& options, unsigned index)
+{
+    if (options.pin)
+        pin_reactor(index);
+
+    auto the_epoll = epoll::create(options.edge_triggered, options.zero_copy);
+    if (!the_epoll)
+    {
+        log_error(the_epoll.error());
+        return;
+    }
+
+    the_epoll->handle(options.handler);
+    the_epoll->resolve_names(options.resolve_names);
+    the_epoll->timeouts(options.timeouts);
+    the_epoll->max_queued(options.max_queued);
+    if (options.pool)
+        if (auto offloaded = the_epoll->offload(*options.pool); !offloaded)
+        {
+            log_error(offloaded.error());
+            return;
+        }
 
-    std::string_view hostname = "localhost";
-    std::string_view port = "8080";
     addrinfo hints =
     {
         .ai_family = AF_UNSPEC,
         .ai_socktype = SOCK_STREAM
     };
-    int backlog = true ? 16 : SOMAXCONN;
-    the_epoll->listen(std::data(hostname), std::data(port), &hints, backlog);
+    if (auto listening = the_epoll->listen(options.hostname, options.port, &hints, options.backlog, true); !listening)
+    {
+        log_error(listening.error());
+        return;
+    }
 
-    int max_events = 16;
-    int timeout = 1000;
-    std::vector<struct epoll_event> events(max_events);
+    std::vector<struct epoll_event> events(options.max_events);
 
-    while (true)
+    while (!stop.stop_requested())
     {
-        auto expected = the_epoll->wait(events, timeout);
+        auto expected = the_epoll->wait(events, options.timeout);
         if (expected)
             continue;
 
-        std::cerr << expected.error();
         if (expected.error().value() == EINTR)
             // 系統調用被信號中斷，需要重新執行 epoll_wait
             continue;
 
+        log_error(expected.error());
         break;
     }
+}
+
+static void usage(const char* name)
+{
+    std::println(std::cerr, "Usage: {} [--host NAME] [--port PORT] [--reactors N] [--pin] [--pool N]"
+                            " [--edge] [--zero-copy] [--backlog N] [--max-events N]"
+                            " [--log-level trace|debug|info|warning|error|off] [--no-resolve]"
+                            " [--idle-timeout MS] [--write-timeout MS] [--close-timeout MS]"
+                            " [--max-queued BYTES]", name);
+}
+
+int main(int argc, char* argv[])
+{
+    server_options options;
+    unsigned pool_threads = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (arg == "--pin")
+        {
+            options.pin = true;
+            continue;
+        }
+
+        if (arg == "--edge")
+        {
+            options.edge_triggered = true;
+            continue;
+        }
+
+        if (arg == "--zero-copy")
+        {
+            options.zero_copy = true;
+            continue;
+        }
+
+        if (arg == "--no-resolve")
+        {
+            options.resolve_names = false;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        if (arg == "--host")
+            options.hostname = argv[++i];
+        else if (arg == "--port")
+            options.port = argv[++i];
+        else if (arg == "--reactors")
+            options.reactors = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--pool")
+            pool_threads = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--backlog")
+            options.backlog = std::max(1l, std::strtol(argv[++i], nullptr, 10));
+        else if (arg == "--max-events")
+            options.max_events = std::max(1l, std::strtol(argv[++i], nullptr, 10));
+        else if (arg == "--idle-timeout")
+            options.timeouts.idle = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--write-timeout")
+            options.timeouts.write = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--close-timeout")
+            options.timeouts.close = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--max-queued")
+            options.max_queued = std::max(2ul, std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--log-level")
+        {
+            auto level = std::ranges::find(log_level_names, argv[++i]);
+            if (level == std::end(log_level_names))
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            logger::instance().level(static_cast<log_level>(level - std::begin(log_level_names)));
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // splice has no MSG_NOSIGNAL, a peer that went away must not kill the server
+    ::signal(SIGPIPE, SIG_IGN);
+
+    std::optional<ThreadPool> pool;
+    if (pool_threads)
+        options.pool = &pool.emplace(pool_threads);
+
+    // the reactors inherit the blocked signals, so SIGINT and SIGTERM are
+    // only delivered to sigwait below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::vector<std::jthread> reactors;
+    for (unsigned index = 0; index < options.reactors; ++index)
+        reactors.emplace_back(run_reactor, std::cref(options), index);
+
+    int signal;
+    ::sigwait(&signals, &signal);
+    log<log_level::info>("signal {}, stopping", signal);
+
+    // a reactor notices within one epoll_wait timeout
+    for (auto& reactor : reactors)
+        reactor.request_stop();
 
     return 0;
-}
\ No newline at end of file
+}
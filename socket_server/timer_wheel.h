@@ -0,0 +1,223 @@
+#ifndef SOCKET_SERVER_TIMER_WHEEL_H
+#define SOCKET_SERVER_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// a hierarchical timer wheel with millisecond ticks. 4 levels of 64 slots
+// cover about 4.6 hours, later deadlines wait in the last level and are
+// placed again once they come closer. timers are identified by a small
+// integer, a descriptor number, and kept in doubly linked lists of indices,
+// so arm and cancel are O(1) no matter how many timers are running.
+class timer_wheel
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr int slot_bits = 6;
+    static constexpr int slots = 1 << slot_bits;
+    static constexpr int levels = 4;
+
+    explicit timer_wheel(clock::time_point now = clock::now()) :
+        m_start(now)
+    {
+        m_heads.fill(none);
+    }
+
+    // (re)arms timer id, a deadline in the past expires on the next tick
+    void arm(std::uint32_t id, clock::time_point deadline)
+    {
+        if (id >= std::size(m_entries))
+            m_entries.resize(id + 1);
+
+        cancel(id);
+
+        entry& the_entry = m_entries[id];
+        the_entry.expiry = std::max(to_tick(deadline), m_now + 1);
+        the_entry.armed = true;
+        link(id);
+        ++m_count;
+    }
+
+    void cancel(std::uint32_t id)
+    {
+        if (id >= std::size(m_entries) || !m_entries[id].armed)
+            return;
+
+        unlink(id);
+        m_entries[id].armed = false;
+        --m_count;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return m_count;
+    }
+
+    // calls expired(id) for every timer due by now. expired may arm and
+    // cancel timers, including the one that expired.
+    template<class F>
+    void advance(clock::time_point now, F&& expired)
+    {
+        const std::uint64_t target = to_tick(now);
+        while (m_now < target)
+        {
+            // nothing can be due before the next occupied slot
+            const std::uint64_t due = next_due();
+            if (due > target)
+            {
+                m_now = target;
+                break;
+            }
+
+            m_now = std::max(m_now + 1, due);
+
+            // a lower level went round, move the next slot of the level above down
+            for (int level = 1; level < levels; ++level)
+            {
+                if (index(m_now, level - 1) != 0)
+                    break;
+                cascade(level, index(m_now, level));
+            }
+
+            const int slot = index(m_now, 0);
+            while (m_heads[slot] != none)
+            {
+                std::uint32_t id = m_heads[slot];
+                unlink(id);
+                m_entries[id].armed = false;
+                --m_count;
+                expired(id);
+            }
+        }
+    }
+
+    // milliseconds until the next timer may be due, capped at limit, for
+    // epoll_wait. a timer above the lowest level counts from when its slot
+    // moves down, which wakes the caller early at worst, never late.
+    int timeout(clock::time_point now, int limit) const
+    {
+        if (m_count == 0)
+            return limit;
+
+        const std::uint64_t current = to_tick(now);
+        const std::uint64_t next = next_due();
+        if (next <= current)
+            return 0;
+        return static_cast<int>(std::min<std::uint64_t>(next - current, limit < 0 ? std::numeric_limits<int>::max() : limit));
+    }
+
+private:
+    static constexpr std::uint32_t none = std::numeric_limits<std::uint32_t>::max();
+
+    struct entry
+    {
+        std::uint64_t expiry = 0;
+        std::uint32_t previous = none;
+        std::uint32_t next = none;
+        std::uint16_t bucket = 0;
+        bool armed = false;
+    };
+
+    std::uint64_t to_tick(clock::time_point time) const
+    {
+        if (time <= m_start)
+            return 0;
+        return std::chrono::duration_cast<std::chrono::milliseconds>(time - m_start).count();
+    }
+
+    // the tick the next occupied slot is processed at, for the lowest level
+    // when its timers fire, above it when they move down a level
+    std::uint64_t next_due() const
+    {
+        std::uint64_t next = std::numeric_limits<std::uint64_t>::max();
+        for (int level = 0; level < levels; ++level)
+        {
+            if (!m_occupied[level])
+                continue;
+
+            // the first occupied slot after the current one, going round
+            const int position = index(m_now, level);
+            const int offset = std::countr_zero(std::rotr(m_occupied[level], position + 1)) + 1;
+            const int shift = slot_bits * level;
+            next = std::min(next, ((m_now >> shift) + offset) << shift);
+        }
+        return next;
+    }
+
+    static int index(std::uint64_t tick, int level)
+    {
+        return static_cast<int>((tick >> (slot_bits * level)) & (slots - 1));
+    }
+
+    // the bucket for an expiry, by how far ahead of the current tick it is
+    int bucket(std::uint64_t expiry) const
+    {
+        const std::uint64_t delta = expiry - m_now;
+        for (int level = 0; level < levels - 1; ++level)
+            if (delta < (std::uint64_t(1) << (slot_bits * (level + 1))))
+                return level * slots + index(expiry, level);
+
+        // beyond the wheel, it waits in the slot of the last level going round last
+        constexpr int last = levels - 1;
+        const std::uint64_t span = std::uint64_t(1) << (slot_bits * levels);
+        return last * slots + index(delta < span ? expiry : m_now + span - 1, last);
+    }
+
+    void link(std::uint32_t id)
+    {
+        entry& the_entry = m_entries[id];
+        const int b = bucket(the_entry.expiry);
+        the_entry.bucket = static_cast<std::uint16_t>(b);
+        the_entry.previous = none;
+        the_entry.next = m_heads[b];
+        if (the_entry.next != none)
+            m_entries[the_entry.next].previous = id;
+        m_heads[b] = id;
+        m_occupied[b / slots] |= std::uint64_t(1) << (b % slots);
+    }
+
+    void unlink(std::uint32_t id)
+    {
+        entry& the_entry = m_entries[id];
+        const int b = the_entry.bucket;
+        if (the_entry.previous != none)
+            m_entries[the_entry.previous].next = the_entry.next;
+        else
+            m_heads[b] = the_entry.next;
+        if (the_entry.next != none)
+            m_entries[the_entry.next].previous = the_entry.previous;
+        if (m_heads[b] == none)
+            m_occupied[b / slots] &= ~(std::uint64_t(1) << (b % slots));
+    }
+
+    void cascade(int level, int slot)
+    {
+        const int b = level * slots + slot;
+        std::uint32_t id = m_heads[b];
+        m_heads[b] = none;
+        m_occupied[level] &= ~(std::uint64_t(1) << slot);
+        while (id != none)
+        {
+            std::uint32_t next = m_entries[id].next;
+            link(id);
+            id = next;
+        }
+    }
+
+    clock::time_point m_start;
+    // the last tick that has been processed
+    std::uint64_t m_now = 0;
+    std::size_t m_count = 0;
+    std::array<std::uint32_t, levels * slots> m_heads;
+    // a bit per non-empty slot, for finding the next expiry
+    std::array<std::uint64_t, levels> m_occupied{};
+    std::vector<entry> m_entries;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// a per thread free list of memory blocks of one size, so objects that are
+// created and destroyed at a high rate are recycled instead of going back
+// to the global allocator every time. blocks freed on another thread than
+// the one that allocated them travel back in batches through a shared depot.
+template<std::size_t Size>
+class BlockCache {
+public:
+    static BlockCache& local()
+    {
+        static thread_local BlockCache cache;
+        return cache;
+    }
+
+    void* allocate()
+    {
+        if(!free.head)
+            free = depot().take();
+        if(free.head)
+            return free.pop();
+        return ::operator new(block_size);
+    }
+
+    void deallocate(void* block) noexcept
+    {
+        free.push(block);
+        if(free.count >= 2 * batch_size)
+            depot().give(free.split(batch_size));
+    }
+
+    ~BlockCache()
+    {
+        while(free.count > batch_size)
+            depot().give(free.split(batch_size));
+        depot().give(free);
+        free = {};
+    }
+
+private:
+    struct node {
+        node* next;
+    };
+
+    struct list {
+        node* head = nullptr;
+        std::size_t count = 0;
+
+        void push(void* block) noexcept
+        {
+            head = ::new(block) node{ head };
+            ++count;
+        }
+
+        void* pop() noexcept
+        {
+            node* block = head;
+            head = block->next;
+            --count;
+            return block;
+        }
+
+        // detaches the first n blocks
+        list split(std::size_t n) noexcept
+        {
+            list front{ head, n };
+            node* last = head;
+            for(std::size_t i = 1; i < n; ++i)
+                last = last->next;
+            head = last->next;
+            last->next = nullptr;
+            count -= n;
+            return front;
+        }
+
+        void clear() noexcept
+        {
+            while(head)
+                ::operator delete(pop());
+        }
+    };
+
+    // a mutex guarded stack of batches shared by all threads
+    class Depot {
+    public:
+        list take()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(batches.empty())
+                return {};
+            list batch = batches.back();
+            batches.pop_back();
+            return batch;
+        }
+
+        void give(list batch) noexcept
+        {
+            if(!batch.head)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(batches.size() < batches.capacity())
+                {
+                    batches.push_back(batch);
+                    return;
+                }
+            }
+            batch.clear();
+        }
+
+        Depot() { batches.reserve(depot_batches); }
+
+        ~Depot()
+        {
+            for(list& batch: batches)
+                batch.clear();
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<list> batches;
+    };
+
+    static Depot& depot()
+    {
+        static Depot instance;
+        return instance;
+    }
+
+    static constexpr std::size_t block_size = Size < sizeof(node) ? sizeof(node) : Size;
+    static constexpr std::size_t batch_size = 32;
+    // upper bound of idle batches kept across all threads
+    static constexpr std::size_t depot_batches = 64;
+
+    BlockCache() { depot(); }
+
+    list free;
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef COUNTING_ALLOCATOR_H
+#define COUNTING_ALLOCATOR_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// replaces the global operator new with one that counts its calls, so a
+// benchmark or a test can tell how often the heap is touched. it defines
+// the replacement functions, include it from one translation unit of a
+// program only.
+
+inline std::atomic<unsigned long long> allocations{0};
+
+void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+#endif
@@ -0,0 +1,380 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "BlockCache.h"
+#include "UniqueFunction.h"
+
+template<class T> class Future;
+template<class T> class Promise;
+
+// the error a future reports when its task was cancelled or dropped before
+// it started
+class TaskCancelled : public std::runtime_error {
+public:
+    TaskCancelled() : std::runtime_error("task cancelled") {}
+};
+
+// the state shared by one Promise and one Future, its memory is recycled
+// through a per thread BlockCache so the hot path doesn't allocate
+template<class T>
+class FutureState {
+public:
+    using value_type = std::conditional_t<std::is_void_v<T>, std::monostate,
+                       std::conditional_t<std::is_reference_v<T>,
+                                          std::reference_wrapper<std::remove_reference_t<T>>, T>>;
+
+    static void* operator new(std::size_t)
+    {
+        return BlockCache<sizeof(FutureState)>::local().allocate();
+    }
+
+    static void operator delete(void* p) noexcept
+    {
+        BlockCache<sizeof(FutureState)>::local().deallocate(p);
+    }
+
+    void acquire() noexcept { refs.fetch_add(1, std::memory_order_relaxed); }
+
+    // whoever claims the state first, the task starting or a cancel, gets to
+    // satisfy it, everybody else leaves it alone
+    bool claim() noexcept { return !claimed.exchange(true, std::memory_order_acq_rel); }
+
+    void release() noexcept
+    {
+        if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    template<class... V>
+    void set_value(V&&... v)
+    {
+        value.emplace(std::forward<V>(v)...);
+        publish();
+    }
+
+    void set_exception(std::exception_ptr e)
+    {
+        exception = std::move(e);
+        publish();
+    }
+
+    bool is_ready() const noexcept
+    {
+        return status.load(std::memory_order_acquire) == ready;
+    }
+
+    // runs continuation once the state is ready, right away if it already is
+    void chain(UniqueFunction continuation)
+    {
+        this->continuation = std::move(continuation);
+
+        int expected = status.load(std::memory_order_relaxed);
+        while(expected != ready)
+            if(status.compare_exchange_weak(expected, continued, std::memory_order_acq_rel))
+                return;
+
+        std::exchange(this->continuation, {})();
+    }
+
+    void wait()
+    {
+        if(is_ready())
+            return;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        announce_waiter();
+        condition.wait(lock, [this]{ return is_ready(); });
+    }
+
+    template<class Clock, class Duration>
+    bool wait_until(const std::chrono::time_point<Clock, Duration>& time)
+    {
+        if(is_ready())
+            return true;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        announce_waiter();
+        return condition.wait_until(lock, time, [this]{ return is_ready(); });
+    }
+
+    value_type& get()
+    {
+        if(exception)
+            std::rethrow_exception(exception);
+        return *value;
+    }
+
+private:
+    enum : int { pending, waiting, continued, ready };
+
+    // the setter only takes the mutex when a waiter has announced itself
+    void announce_waiter()
+    {
+        int expected = pending;
+        status.compare_exchange_strong(expected, waiting, std::memory_order_acq_rel);
+    }
+
+    void publish()
+    {
+        switch(status.exchange(ready, std::memory_order_acq_rel))
+        {
+        case waiting:
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                condition.notify_all();
+            }
+            break;
+        case continued:
+            std::exchange(continuation, {})();
+            break;
+        }
+    }
+
+    std::atomic<unsigned> refs{1};
+    std::atomic<int> status{pending};
+    std::atomic<bool> claimed{false};
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::optional<value_type> value;
+    std::exception_ptr exception;
+    UniqueFunction continuation;
+};
+
+// the consumer side, like std::future but without a separate heap allocation
+template<class T>
+class Future {
+public:
+    Future() noexcept = default;
+    Future(Future&& other) noexcept : state(std::exchange(other.state, nullptr)) {}
+    Future& operator=(Future&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(state)
+                state->release();
+            state = std::exchange(other.state, nullptr);
+        }
+        return *this;
+    }
+    ~Future() { if(state) state->release(); }
+
+    bool valid() const noexcept { return state != nullptr; }
+    bool is_ready() const noexcept { return state->is_ready(); }
+
+    void wait() const { state->wait(); }
+
+    template<class Rep, class Period>
+    std::future_status wait_for(const std::chrono::duration<Rep, Period>& duration) const
+    {
+        return wait_until(std::chrono::steady_clock::now() + duration);
+    }
+
+    template<class Clock, class Duration>
+    std::future_status wait_until(const std::chrono::time_point<Clock, Duration>& time) const
+    {
+        return state->wait_until(time) ? std::future_status::ready : std::future_status::timeout;
+    }
+
+    // like std::future::get, the future is no longer valid afterwards
+    T get()
+    {
+        if(!state)
+            throw std::future_error(std::future_errc::no_state);
+
+        FutureState<T>* s = std::exchange(state, nullptr);
+        struct releaser {
+            FutureState<T>* s;
+            ~releaser() { s->release(); }
+        } guard{ s };
+
+        s->wait();
+        if constexpr(std::is_void_v<T>)
+            s->get();
+        else if constexpr(std::is_reference_v<T>)
+            return s->get().get();
+        else
+            return std::move(s->get());
+    }
+
+    // cancels the task behind the future unless it has started already: the
+    // future becomes ready with a TaskCancelled error right away and the
+    // task is skipped once a worker gets to it. false if it was too late.
+    bool cancel()
+    {
+        if(!state || !state->claim())
+            return false;
+        state->set_exception(std::make_exception_ptr(TaskCancelled()));
+        return true;
+    }
+
+    // schedules f on executor once the result is ready, f gets the value
+    // (nothing for Future<void>) and an exception skips f and carries over
+    // to the returned future. the future is no longer valid afterwards.
+    template<class Executor, class F>
+    auto then(Executor& executor, F&& f);
+
+private:
+    friend class Promise<T>;
+    explicit Future(FutureState<T>* state) noexcept : state(state) {}
+
+    FutureState<T>* state = nullptr;
+};
+
+// the producer side, a promise that is destroyed without being satisfied
+// leaves a broken_promise error behind
+template<class T>
+class Promise {
+public:
+    Promise() : state(new FutureState<T>) {}
+    Promise(Promise&& other) noexcept : state(std::exchange(other.state, nullptr)) {}
+    Promise& operator=(Promise&& other) noexcept
+    {
+        if(this != &other)
+        {
+            abandon();
+            state = std::exchange(other.state, nullptr);
+        }
+        return *this;
+    }
+    ~Promise() { abandon(); }
+
+    Future<T> get_future()
+    {
+        state->acquire();
+        return Future<T>(state);
+    }
+
+    // a promise is satisfied at most once, it lets go of the state right
+    // after publishing so the waiting side usually frees it into its own cache.
+    // a promise whose future has been cancelled just lets go.
+    template<class... V>
+    void set_value(V&&... v)
+    {
+        if(state->claim())
+            state->set_value(std::forward<V>(v)...);
+        std::exchange(state, nullptr)->release();
+    }
+
+    void set_exception(std::exception_ptr e)
+    {
+        if(state->claim())
+            state->set_exception(std::move(e));
+        std::exchange(state, nullptr)->release();
+    }
+
+    // invokes f with args and stores whatever it returns or throws, f isn't
+    // called at all once the future has been cancelled
+    template<class F, class... Args>
+    void set_result(F&& f, Args&&... args)
+    {
+        FutureState<T>* s = std::exchange(state, nullptr);
+        if(s->claim())
+        {
+            try
+            {
+                if constexpr(std::is_void_v<T>)
+                {
+                    std::invoke(std::forward<F>(f), std::forward<Args>(args)...);
+                    s->set_value();
+                }
+                else
+                    s->set_value(std::invoke(std::forward<F>(f), std::forward<Args>(args)...));
+            }
+            catch(...)
+            {
+                s->set_exception(std::current_exception());
+            }
+        }
+        s->release();
+    }
+
+    // reports TaskCancelled, for a task that is given up before it ran
+    void cancel() noexcept
+    {
+        if(state)
+            set_exception(std::make_exception_ptr(TaskCancelled()));
+    }
+
+private:
+    void abandon() noexcept
+    {
+        if(state)
+            set_exception(std::make_exception_ptr(
+                std::future_error(std::future_errc::broken_promise)));
+    }
+
+    FutureState<T>* state;
+};
+
+template<class T>
+template<class Executor, class F>
+auto Future<T>::then(Executor& executor, F&& f)
+{
+    using result_type = typename decltype([]{
+        if constexpr(std::is_void_v<T>)
+            return std::type_identity<std::invoke_result_t<F>>{};
+        else
+            return std::type_identity<std::invoke_result_t<F, T>>{};
+    }())::type;
+
+    if(!state)
+        throw std::future_error(std::future_errc::no_state);
+
+    Promise<result_type> promise;
+    Future<result_type> res = promise.get_future();
+
+    FutureState<T>* s = state;
+    s->chain(
+        [&executor,
+         antecedent = std::move(*this),
+         promise = std::move(promise),
+         f = std::forward<F>(f)]() mutable
+        {
+            try
+            {
+                executor.post(
+                    [antecedent = std::move(antecedent),
+                     promise = std::move(promise),
+                     f = std::move(f)]() mutable
+                    {
+                        try
+                        {
+                            if constexpr(std::is_void_v<T>)
+                            {
+                                antecedent.get();
+                                promise.set_result(std::move(f));
+                            }
+                            else
+                                promise.set_result(std::move(f), antecedent.get());
+                        }
+                        catch(...)
+                        {
+                            promise.set_exception(std::current_exception());
+                        }
+                    }
+                );
+            }
+            catch(...)
+            {
+                // the executor refused the task and dropped the promise
+                // with it, the returned future reports broken_promise
+            }
+        }
+    );
+    return res;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef LOCKED_QUEUE_H
+#define LOCKED_QUEUE_H
+
+#include <cstddef>
+#include <mutex>
+#include <utility>
+
+#include "RingDeque.h"
+
+// the default ThreadPool queue policy: a mutex guarded FIFO that grows
+// without bound.
+//
+// a queue policy is a class template over the element type with
+//  - a constructor taking a capacity hint, which unbounded queues ignore,
+//  - bool try_push(T& value), which moves value in and returns true, or
+//    leaves value alone and returns false when the queue is full,
+//  - bool try_pop(T& value), which moves the oldest element out or returns
+//    false when it finds the queue empty,
+//  - static constexpr bool multi_consumer, false when concurrent try_pop
+//    calls have to be serialized by the caller,
+//  - std::size_t capacity() const, the most elements it can hold.
+template<class T>
+class LockedQueue {
+public:
+    static constexpr bool multi_consumer = true;
+
+    explicit LockedQueue(std::size_t) {}
+
+    bool try_push(T& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        items.push_back(std::move(value));
+        return true;
+    }
+
+    bool try_pop(T& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(items.empty())
+            return false;
+        value = std::move(items.front());
+        items.pop_front();
+        return true;
+    }
+
+    std::size_t capacity() const noexcept { return static_cast<std::size_t>(-1); }
+
+private:
+    std::mutex mutex;
+    RingDeque<T> items;
+};
+
+#endif
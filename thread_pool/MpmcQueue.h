@@ -0,0 +1,96 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// a bounded lock free multi producer multi consumer FIFO on a power of two
+// ring. every slot carries a sequence number that tells producers and
+// consumers whose turn it is, so a push or pop is one compare exchange on
+// its index plus a release store on the slot. the two indices sit on their
+// own cache lines, producers and consumers don't invalidate each other.
+template<class T>
+class MpmcQueue {
+public:
+    static constexpr bool multi_consumer = true;
+
+    explicit MpmcQueue(std::size_t capacity)
+        :   mask(std::bit_ceil(capacity < 2 ? std::size_t(2) : capacity) - 1),
+            slots(new slot[mask + 1])
+    {
+        for(std::size_t i = 0; i <= mask; ++i)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+    bool try_push(T& value)
+    {
+        std::size_t position = tail.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            slot& s = slots[position & mask];
+            const std::size_t sequence = s.sequence.load(std::memory_order_acquire);
+            const auto lag = static_cast<std::ptrdiff_t>(sequence - position);
+            if(lag == 0)
+            {
+                if(tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    s.value = std::move(value);
+                    s.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            // the slot still holds the element from one lap ago
+            else if(lag < 0)
+                return false;
+            else
+                position = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool try_pop(T& value)
+    {
+        std::size_t position = head.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            slot& s = slots[position & mask];
+            const std::size_t sequence = s.sequence.load(std::memory_order_acquire);
+            const auto lag = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+            if(lag == 0)
+            {
+                if(head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    value = std::move(s.value);
+                    s.value = T();
+                    s.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            // nothing has been published in this slot yet
+            else if(lag < 0)
+                return false;
+            else
+                position = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    std::size_t capacity() const noexcept { return mask + 1; }
+
+private:
+    struct slot {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    const std::size_t mask;
+    const std::unique_ptr<slot[]> slots;
+    alignas(64) std::atomic<std::size_t> tail{0};
+    alignas(64) std::atomic<std::size_t> head{0};
+};
+
+#endif
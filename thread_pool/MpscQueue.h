@@ -0,0 +1,180 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+
+// an unbounded intrusive multi producer single consumer FIFO: elements are
+// linked through a next pointer in their node and a push is a single
+// exchange on the tail, producers never wait for each other. only one
+// thread may pop at a time. nodes come from slabs the queue owns, each one
+// twice the size of the one before, and popped nodes go back onto a free
+// stack of the queue. like a RingDeque's buffer, a queue keeps as many
+// nodes as it once held and steady pushing doesn't allocate.
+template<class T>
+class MpscQueue {
+public:
+    static constexpr bool multi_consumer = false;
+
+    explicit MpscQueue(std::size_t) : head(&stub), tail(&stub) {}
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    ~MpscQueue()
+    {
+        T value;
+        while(try_pop(value))
+            ;
+        for(auto& slab: slabs)
+            delete[] slab.load(std::memory_order_relaxed);
+    }
+
+    bool try_push(T& value)
+    {
+        node* n = allocate();
+        n->value = std::move(value);
+        link(n);
+        return true;
+    }
+
+    // may miss an element whose producer has swapped the tail but not yet
+    // linked it, the element shows up on a later pop
+    bool try_pop(T& value)
+    {
+        node* first = head;
+        node* next = first->next.load(std::memory_order_acquire);
+        if(first == &stub)
+        {
+            if(!next)
+                return false;
+            head = first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if(!next)
+        {
+            if(first != tail.load(std::memory_order_acquire))
+                return false;
+            // first is the last node, put the stub behind it so it can go
+            link(&stub);
+            next = first->next.load(std::memory_order_acquire);
+            if(!next)
+                return false;
+        }
+        head = next;
+        value = std::move(first->value);
+        first->value = T();
+        release(first, first);
+        return true;
+    }
+
+    std::size_t capacity() const noexcept { return static_cast<std::size_t>(-1); }
+
+private:
+    struct node {
+        std::atomic<node*> next{nullptr};
+        // the node below on the free stack, as index + 1, 0 at the bottom
+        std::atomic<std::uint32_t> below{0};
+        // where the node sits in the slabs
+        std::uint32_t index = 0;
+        T value;
+    };
+
+    // the first slab's nodes, slab k holds slab_base << k
+    static constexpr std::size_t slab_base = 64;
+    // as many slabs as indices + 1 fit into 32 bits
+    static constexpr std::size_t max_slabs = 26;
+
+    node* at(std::uint32_t index) const noexcept
+    {
+        const std::size_t slab = std::bit_width(index / slab_base + 1) - 1;
+        const std::size_t first = slab_base * ((std::size_t(1) << slab) - 1);
+        return slabs[slab].load(std::memory_order_acquire) + (index - first);
+    }
+
+    // pops a node off the free stack. its top is the node's index + 1 in the
+    // low half and a count bumped by every pop and push in the high half, so
+    // a producer that read a top which has been popped and pushed again
+    // since fails its compare exchange instead of linking in a stale node
+    node* allocate()
+    {
+        if(node* n = pop_free())
+            return n;
+
+        // out of nodes, the next slab is made under a lock. the other
+        // producers only wait for that while the queue is growing.
+        std::lock_guard<std::mutex> lock(grow_mutex);
+        if(node* n = pop_free())
+            return n;
+
+        if(slab_count == max_slabs)
+            throw std::bad_alloc();
+        const std::size_t size = slab_base << slab_count;
+        const std::size_t first = slab_base * ((std::size_t(1) << slab_count) - 1);
+        node* slab = new node[size];
+        for(std::size_t i = 0; i < size; ++i)
+        {
+            slab[i].index = static_cast<std::uint32_t>(first + i);
+            if(i + 1 < size)
+                slab[i].below.store(static_cast<std::uint32_t>(first + i + 2), std::memory_order_relaxed);
+        }
+        slabs[slab_count++].store(slab, std::memory_order_release);
+
+        // the first one is ours, the rest go onto the free stack at once
+        if(size > 1)
+            release(slab + 1, slab + size - 1);
+        return slab;
+    }
+
+    node* pop_free() noexcept
+    {
+        std::uint64_t top = free_top.load(std::memory_order_acquire);
+        for(;;)
+        {
+            const auto index = static_cast<std::uint32_t>(top);
+            if(index == 0)
+                return nullptr;
+            node* n = at(index - 1);
+            const std::uint64_t below = n->below.load(std::memory_order_relaxed);
+            if(free_top.compare_exchange_weak(top, ((top >> 32) + 1) << 32 | below,
+                                              std::memory_order_acquire, std::memory_order_acquire))
+                return n;
+        }
+    }
+
+    // pushes the chain from first down to last, already linked through below
+    void release(node* first, node* last) noexcept
+    {
+        std::uint64_t top = free_top.load(std::memory_order_relaxed);
+        do
+            last->below.store(static_cast<std::uint32_t>(top), std::memory_order_relaxed);
+        while(!free_top.compare_exchange_weak(top, ((top >> 32) + 1) << 32 | (first->index + 1),
+                                              std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    void link(node* n) noexcept
+    {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        node* previous = tail.exchange(n, std::memory_order_acq_rel);
+        previous->next.store(n, std::memory_order_release);
+    }
+
+    // only touched by the consumer
+    node* head;
+    node stub;
+    alignas(64) std::atomic<node*> tail;
+    // pushed by the consumer, popped by producers
+    alignas(64) std::atomic<std::uint64_t> free_top{0};
+    std::array< std::atomic<node*>, max_slabs > slabs{};
+    // guards slab_count, taken only to add a slab
+    std::mutex grow_mutex;
+    std::size_t slab_count = 0;
+};
+
+#endif
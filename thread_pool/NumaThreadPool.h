@@ -0,0 +1,119 @@
+#ifndef NUMA_THREAD_POOL_H
+#define NUMA_THREAD_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+
+#include "ThreadPool.h"
+#include "Topology.h"
+
+// one ThreadPool per NUMA node with its workers pinned to the node's cpus,
+// so tasks and the memory they first touch stay on one node
+class NumaThreadPool {
+public:
+    // every node gets a fixed pool with one worker per cpu
+    NumaThreadPool();
+    // min_threads and max_threads apply per node, capped at its cpu count
+    explicit NumaThreadPool(ThreadPoolOptions options);
+
+    // runs on the node of the cpu the calling thread is on, whether or not
+    // it belongs to the pool. round robin only when sched_getcpu fails or
+    // reports a cpu outside of every node
+    template<class F, class... Args>
+        requires std::invocable<F, Args...>
+    auto enqueue(F&& f, Args&&... args)
+        -> Future<std::invoke_result_t<F, Args...>>;
+    // runs on the preferred node
+    template<class F, class... Args>
+    auto enqueue_on(size_t node, F&& f, Args&&... args)
+        -> Future<std::invoke_result_t<F, Args...>>;
+    template<class F, class... Args>
+        requires std::invocable<F, Args...>
+    void post(F&& f, Args&&... args);
+    template<class F, class... Args>
+    void post_on(size_t node, F&& f, Args&&... args);
+
+    size_t node_count() const { return pools.size(); }
+    const NumaNode& node(size_t index) const { return nodes[index]; }
+    ThreadPool& pool(size_t index) { return *pools[index]; }
+    // the node index of the cpu the calling thread runs on right now
+    size_t local_node();
+
+private:
+    std::vector<NumaNode> nodes;
+    std::vector< std::unique_ptr<ThreadPool> > pools;
+    // node index by cpu number
+    std::vector<size_t> cpu_node;
+    std::atomic<size_t> next_node{0};
+};
+
+inline NumaThreadPool::NumaThreadPool()
+    :   NumaThreadPool(ThreadPoolOptions::fixed(CPU_SETSIZE))
+{
+}
+
+inline NumaThreadPool::NumaThreadPool(ThreadPoolOptions options)
+    :   nodes(numa_nodes())
+{
+    for(const NumaNode& node: nodes)
+    {
+        // a node without cpus is the fallback for a process whose affinity
+        // couldn't be read, its workers stay unpinned
+        const size_t cpus = node.cpus.empty() ? std::max(1u, std::thread::hardware_concurrency())
+                                              : node.cpus.size();
+        ThreadPoolOptions node_options = options;
+        node_options.cpus = node.cpus;
+        node_options.max_threads = std::min(options.max_threads, cpus);
+        node_options.min_threads = std::min(options.min_threads, node_options.max_threads);
+        pools.emplace_back(new ThreadPool(node_options));
+
+        for(int cpu: node.cpus)
+        {
+            if(cpu_node.size() <= static_cast<size_t>(cpu))
+                cpu_node.resize(cpu + 1, nodes.size());
+            cpu_node[cpu] = pools.size() - 1;
+        }
+    }
+}
+
+inline size_t NumaThreadPool::local_node()
+{
+    int cpu = ::sched_getcpu();
+    if(cpu >= 0 && static_cast<size_t>(cpu) < cpu_node.size() && cpu_node[cpu] < pools.size())
+        return cpu_node[cpu];
+    return next_node.fetch_add(1, std::memory_order_relaxed) % pools.size();
+}
+
+template<class F, class... Args>
+    requires std::invocable<F, Args...>
+auto NumaThreadPool::enqueue(F&& f, Args&&... args)
+    -> Future<std::invoke_result_t<F, Args...>>
+{
+    return pools[local_node()]->enqueue(std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<class F, class... Args>
+auto NumaThreadPool::enqueue_on(size_t node, F&& f, Args&&... args)
+    -> Future<std::invoke_result_t<F, Args...>>
+{
+    return pools[node % pools.size()]->enqueue(std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<class F, class... Args>
+    requires std::invocable<F, Args...>
+void NumaThreadPool::post(F&& f, Args&&... args)
+{
+    pools[local_node()]->post(std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<class F, class... Args>
+void NumaThreadPool::post_on(size_t node, F&& f, Args&&... args)
+{
+    pools[node % pools.size()]->post(std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+#endif
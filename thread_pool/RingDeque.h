@@ -0,0 +1,57 @@
+#ifndef RING_DEQUE_H
+#define RING_DEQUE_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// a double ended queue on a power of two ring buffer, unlike std::deque it
+// keeps its memory when elements are popped, so a queue that is filled and
+// drained over and over stops allocating once it has reached its peak size
+template<class T>
+class RingDeque {
+public:
+    bool empty() const noexcept { return head == tail; }
+    std::size_t size() const noexcept { return tail - head; }
+
+    T& front() { return buffer[head & mask()]; }
+    T& back() { return buffer[(tail - 1) & mask()]; }
+
+    void push_back(T value)
+    {
+        if(size() == buffer.size())
+            grow();
+        buffer[tail++ & mask()] = std::move(value);
+    }
+
+    void push_front(T value)
+    {
+        if(size() == buffer.size())
+            grow();
+        buffer[--head & mask()] = std::move(value);
+    }
+
+    void pop_front() { buffer[head++ & mask()] = T(); }
+    void pop_back() { buffer[--tail & mask()] = T(); }
+
+private:
+    std::size_t mask() const noexcept { return buffer.size() - 1; }
+
+    void grow()
+    {
+        std::vector<T> larger(buffer.empty() ? 16 : buffer.size() * 2);
+        std::size_t count = size();
+        for(std::size_t i = 0; i < count; ++i)
+            larger[i] = std::move(buffer[(head + i) & mask()]);
+        buffer.swap(larger);
+        head = 0;
+        tail = count;
+    }
+
+    std::vector<T> buffer;
+    // free running indices, wrapped by mask() on access
+    std::size_t head = 0;
+    std::size_t tail = 0;
+};
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef THREAD_POOL_STATS_H
+#define THREAD_POOL_STATS_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// ThreadPool instrumentation, compiled in only when THREAD_POOL_STATS is
+// defined. without it every hook below is an empty inline function on an
+// empty member, so a pool built without stats doesn't pay for them.
+
+// durations in log2 buckets: bucket b counts durations below 2^(b+1) ns
+// that are not in a lower bucket, the last bucket collects the rest
+struct LatencyBuckets {
+    static constexpr size_t count = 40;
+    std::array<uint64_t, count> counts{};
+
+    LatencyBuckets& operator+=(const LatencyBuckets& other)
+    {
+        for(size_t b = 0; b < count; ++b)
+            counts[b] += other.counts[b];
+        return *this;
+    }
+
+    uint64_t total() const
+    {
+        uint64_t sum = 0;
+        for(uint64_t c: counts)
+            sum += c;
+        return sum;
+    }
+
+    // upper bound of the bucket holding the p-th percentile, in nanoseconds
+    uint64_t percentile(double p) const
+    {
+        const uint64_t all = total();
+        if(all == 0)
+            return 0;
+        const uint64_t rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(all - 1)) + 1;
+        uint64_t seen = 0;
+        for(size_t b = 0; b < count; ++b)
+            if((seen += counts[b]) >= rank)
+                return uint64_t(2) << b;
+        return uint64_t(2) << (count - 1);
+    }
+};
+
+// a snapshot of one worker's counters
+struct WorkerCounters {
+    uint64_t executed = 0;
+    // where the executed tasks came from
+    uint64_t local = 0;
+    uint64_t global = 0;
+    uint64_t stolen = 0;
+    // steal attempts that found the victim's deque locked
+    uint64_t steal_misses = 0;
+    // idle phases that ended with a task found while spinning, or parked
+    uint64_t spin_hits = 0;
+    uint64_t parks = 0;
+    // time between enqueue and start, and time spent running
+    LatencyBuckets wait;
+    LatencyBuckets run;
+
+    WorkerCounters& operator+=(const WorkerCounters& other)
+    {
+        executed += other.executed;
+        local += other.local;
+        global += other.global;
+        stolen += other.stolen;
+        steal_misses += other.steal_misses;
+        spin_hits += other.spin_hits;
+        parks += other.parks;
+        wait += other.wait;
+        run += other.run;
+        return *this;
+    }
+};
+
+// a snapshot of a whole pool
+struct ThreadPoolStats {
+    // tasks handed to the pool
+    uint64_t submitted = 0;
+    // times the shared queue lock was found taken
+    uint64_t contended = 0;
+    // tasks waiting right now, per lane and with a deadline
+    size_t queued = 0;
+    std::array<size_t, 3> lanes{};
+    size_t deadlines = 0;
+    size_t threads = 0;
+    std::vector<WorkerCounters> workers;
+
+    WorkerCounters total() const
+    {
+        WorkerCounters sum;
+        for(const WorkerCounters& worker: workers)
+            sum += worker;
+        return sum;
+    }
+
+    std::string to_text() const
+    {
+        const WorkerCounters sum = total();
+        std::ostringstream out;
+        out << "threads " << threads << ", submitted " << submitted
+            << ", contended " << contended << ", queued " << queued
+            << " (high " << lanes[0] << ", normal " << lanes[1] << ", low " << lanes[2]
+            << ", deadline " << deadlines << ")\n";
+        out << "executed " << sum.executed << " (local " << sum.local << ", global " << sum.global
+            << ", stolen " << sum.stolen << "), steal misses " << sum.steal_misses
+            << ", spin hits " << sum.spin_hits << ", parks " << sum.parks << '\n';
+        out << "wait ns p50 " << sum.wait.percentile(50) << " p99 " << sum.wait.percentile(99)
+            << " p99.9 " << sum.wait.percentile(99.9) << '\n';
+        out << "run ns p50 " << sum.run.percentile(50) << " p99 " << sum.run.percentile(99)
+            << " p99.9 " << sum.run.percentile(99.9) << '\n';
+        for(size_t i = 0; i < workers.size(); ++i)
+            out << "worker " << i << ": executed " << workers[i].executed
+                << ", stolen " << workers[i].stolen << ", parks " << workers[i].parks << '\n';
+        return out.str();
+    }
+
+    std::string to_json() const
+    {
+        std::ostringstream out;
+        auto buckets = [&out](const LatencyBuckets& histogram)
+        {
+            out << '[';
+            for(size_t b = 0; b < LatencyBuckets::count; ++b)
+                out << (b ? "," : "") << histogram.counts[b];
+            out << ']';
+        };
+        auto counters = [&](const WorkerCounters& c)
+        {
+            out << "{\"executed\":" << c.executed << ",\"local\":" << c.local
+                << ",\"global\":" << c.global << ",\"stolen\":" << c.stolen
+                << ",\"steal_misses\":" << c.steal_misses << ",\"spin_hits\":" << c.spin_hits
+                << ",\"parks\":" << c.parks
+                << ",\"wait_p50_ns\":" << c.wait.percentile(50)
+                << ",\"wait_p99_ns\":" << c.wait.percentile(99)
+                << ",\"run_p50_ns\":" << c.run.percentile(50)
+                << ",\"run_p99_ns\":" << c.run.percentile(99)
+                << ",\"wait_ns_log2\":";
+            buckets(c.wait);
+            out << ",\"run_ns_log2\":";
+            buckets(c.run);
+            out << '}';
+        };
+
+        out << "{\"threads\":" << threads << ",\"submitted\":" << submitted
+            << ",\"contended\":" << contended << ",\"queued\":" << queued
+            << ",\"lanes\":{\"high\":" << lanes[0] << ",\"normal\":" << lanes[1]
+            << ",\"low\":" << lanes[2] << "},\"deadlines\":" << deadlines
+            << ",\"total\":";
+        counters(total());
+        out << ",\"workers\":[";
+        for(size_t i = 0; i < workers.size(); ++i)
+        {
+            if(i)
+                out << ',';
+            counters(workers[i]);
+        }
+        out << "]}";
+        return out.str();
+    }
+};
+
+#ifdef THREAD_POOL_STATS
+
+// when a task entered its queue
+struct EnqueueTime {
+    std::chrono::steady_clock::time_point value;
+
+    static EnqueueTime now() { return { std::chrono::steady_clock::now() }; }
+};
+
+// the live counters of one worker, written only by that worker, so plain
+// relaxed load + store is enough and no locked instruction is needed
+class alignas(64) WorkerStats {
+public:
+    void on_local() noexcept { bump(local); }
+    void on_global() noexcept { bump(global); }
+    void on_stolen() noexcept { bump(stolen); }
+    void on_steal_miss() noexcept { bump(steal_misses); }
+    void on_spin_hit() noexcept { bump(spin_hits); }
+    void on_park() noexcept { bump(parks); }
+
+    // measures one task from its enqueue time until destruction
+    class Run {
+    public:
+        Run(WorkerStats& stats, EnqueueTime enqueued)
+            :   stats(stats), start(std::chrono::steady_clock::now())
+        {
+            record(stats.wait, start - enqueued.value);
+        }
+        ~Run()
+        {
+            record(stats.run, std::chrono::steady_clock::now() - start);
+            bump(stats.executed);
+        }
+    private:
+        WorkerStats& stats;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    WorkerCounters snapshot() const
+    {
+        WorkerCounters c;
+        c.executed = executed.load(std::memory_order_relaxed);
+        c.local = local.load(std::memory_order_relaxed);
+        c.global = global.load(std::memory_order_relaxed);
+        c.stolen = stolen.load(std::memory_order_relaxed);
+        c.steal_misses = steal_misses.load(std::memory_order_relaxed);
+        c.spin_hits = spin_hits.load(std::memory_order_relaxed);
+        c.parks = parks.load(std::memory_order_relaxed);
+        for(size_t b = 0; b < LatencyBuckets::count; ++b)
+        {
+            c.wait.counts[b] = wait[b].load(std::memory_order_relaxed);
+            c.run.counts[b] = run[b].load(std::memory_order_relaxed);
+        }
+        return c;
+    }
+
+private:
+    using histogram = std::array<std::atomic<uint64_t>, LatencyBuckets::count>;
+
+    static void bump(std::atomic<uint64_t>& counter) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static void record(histogram& buckets, std::chrono::steady_clock::duration duration) noexcept
+    {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        const size_t b = ns < 2 ? 0 : static_cast<size_t>(std::bit_width(static_cast<uint64_t>(ns)) - 1);
+        bump(buckets[b < LatencyBuckets::count ? b : LatencyBuckets::count - 1]);
+    }
+
+    std::atomic<uint64_t> executed{0};
+    std::atomic<uint64_t> local{0};
+    std::atomic<uint64_t> global{0};
+    std::atomic<uint64_t> stolen{0};
+    std::atomic<uint64_t> steal_misses{0};
+    std::atomic<uint64_t> spin_hits{0};
+    std::atomic<uint64_t> parks{0};
+    histogram wait{};
+    histogram run{};
+};
+
+// the counters shared by every thread submitting to one pool
+class PoolStats {
+public:
+    void on_submit(size_t count) noexcept { submitted.fetch_add(count, std::memory_order_relaxed); }
+    void on_contention() noexcept { contended.fetch_add(1, std::memory_order_relaxed); }
+
+    uint64_t submit_count() const noexcept { return submitted.load(std::memory_order_relaxed); }
+    uint64_t contention_count() const noexcept { return contended.load(std::memory_order_relaxed); }
+
+private:
+    alignas(64) std::atomic<uint64_t> submitted{0};
+    alignas(64) std::atomic<uint64_t> contended{0};
+};
+
+#else
+
+struct EnqueueTime {
+    static EnqueueTime now() { return {}; }
+};
+
+class WorkerStats {
+public:
+    void on_local() noexcept {}
+    void on_global() noexcept {}
+    void on_stolen() noexcept {}
+    void on_steal_miss() noexcept {}
+    void on_spin_hit() noexcept {}
+    void on_park() noexcept {}
+
+    struct Run {
+        Run(WorkerStats&, EnqueueTime) noexcept {}
+    };
+};
+
+class PoolStats {
+public:
+    void on_submit(size_t) noexcept {}
+    void on_contention() noexcept {}
+};
+
+#endif
+
+#endif
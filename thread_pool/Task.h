@@ -0,0 +1,255 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "BlockCache.h"
+#include "Future.h"
+
+template<class T = void> class Task;
+
+// coroutine frames come from per thread BlockCaches, one per 64 byte size
+// class, so the many short lived coroutines of an await chain are recycled
+// instead of going to the global allocator. frames beyond the largest class
+// are rare and go there anyway.
+class CoroutineFrame {
+public:
+    static void* operator new(std::size_t size)
+    {
+        if(size > max_size)
+            return ::operator new(size);
+        return size_class(size).allocate();
+    }
+
+    static void operator delete(void* frame, std::size_t size) noexcept
+    {
+        if(size > max_size)
+            ::operator delete(frame);
+        else
+            size_class(size).deallocate(frame);
+    }
+
+private:
+    struct size_class_cache {
+        void* (*allocate)();
+        void (*deallocate)(void*) noexcept;
+    };
+
+    template<std::size_t Size>
+    static void* allocate() { return BlockCache<Size>::local().allocate(); }
+
+    template<std::size_t Size>
+    static void deallocate(void* frame) noexcept { BlockCache<Size>::local().deallocate(frame); }
+
+    template<std::size_t... I>
+    static constexpr std::array<size_class_cache, sizeof...(I)> make_classes(std::index_sequence<I...>)
+    {
+        return {{ { &allocate<(I + 1) * granularity>, &deallocate<(I + 1) * granularity> }... }};
+    }
+
+    static const size_class_cache& size_class(std::size_t size)
+    {
+        static constexpr auto classes = make_classes(std::make_index_sequence<max_size / granularity>{});
+        return classes[size == 0 ? 0 : (size - 1) / granularity];
+    }
+
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t max_size = 1024;
+};
+
+// what every Task promise shares: a Task starts suspended and only runs
+// once it is awaited, and when it finishes it transfers straight to the
+// coroutine awaiting it instead of resuming it from a nested call
+class TaskPromiseBase : public CoroutineFrame {
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template<class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            return handle.promise().continuation;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+public:
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    void set_continuation(std::coroutine_handle<> handle) noexcept { continuation = handle; }
+
+private:
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+};
+
+template<class T>
+class TaskPromise : public TaskPromiseBase {
+public:
+    using value_type = std::conditional_t<std::is_reference_v<T>,
+                                          std::reference_wrapper<std::remove_reference_t<T>>, T>;
+
+    Task<T> get_return_object() noexcept;
+
+    template<class V = T>
+        requires std::is_convertible_v<V&&, T>
+    void return_value(V&& v)
+    {
+        result.template emplace<1>(std::forward<V>(v));
+    }
+
+    void unhandled_exception() noexcept { result.template emplace<2>(std::current_exception()); }
+
+    T get()
+    {
+        if(result.index() == 2)
+            std::rethrow_exception(std::get<2>(result));
+        if constexpr(std::is_reference_v<T>)
+            return std::get<1>(result).get();
+        else
+            return std::move(std::get<1>(result));
+    }
+
+private:
+    std::variant<std::monostate, value_type, std::exception_ptr> result;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+    Task<void> get_return_object() noexcept;
+
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { exception = std::current_exception(); }
+
+    void get()
+    {
+        if(exception)
+            std::rethrow_exception(exception);
+    }
+
+private:
+    std::exception_ptr exception;
+};
+
+// a lazily started coroutine producing a T. awaiting it runs it, and the
+// awaiting coroutine continues with its value or exception once it has
+// finished, on whatever thread it finished on. no thread blocks meanwhile.
+template<class T>
+class [[nodiscard]] Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    Task() noexcept = default;
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(handle)
+                handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    ~Task()
+    {
+        if(handle)
+            handle.destroy();
+    }
+
+    bool valid() const noexcept { return static_cast<bool>(handle); }
+    bool done() const noexcept { return handle && handle.done(); }
+
+    auto operator co_await() && noexcept
+    {
+        struct awaiter {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept { return !handle || handle.done(); }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().set_continuation(awaiting);
+                return handle;
+            }
+
+            T await_resume()
+            {
+                if(!handle)
+                    throw std::future_error(std::future_errc::no_state);
+                return handle.promise().get();
+            }
+        };
+        return awaiter{ handle };
+    }
+
+private:
+    friend promise_type;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template<class T>
+Task<T> TaskPromise<T>::get_return_object() noexcept
+{
+    return Task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept
+{
+    return Task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+// a coroutine nobody awaits, it runs eagerly and frees itself at the end
+struct DetachedTask {
+    struct promise_type : CoroutineFrame {
+        DetachedTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+template<class T>
+DetachedTask run_detached(Task<T> task, Promise<T> promise)
+{
+    try
+    {
+        if constexpr(std::is_void_v<T>)
+        {
+            co_await std::move(task);
+            promise.set_value();
+        }
+        else
+            promise.set_value(co_await std::move(task));
+    }
+    catch(...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+}
+
+// starts task on the calling thread right away and reports its result
+// through a Future, the bridge from plain code into a coroutine
+template<class T>
+Future<T> spawn(Task<T> task)
+{
+    Promise<T> promise;
+    Future<T> res = promise.get_future();
+    run_detached(std::move(task), std::move(promise));
+    return res;
+}
+
+#endif
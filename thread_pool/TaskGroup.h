@@ -0,0 +1,137 @@
+#ifndef TASK_GROUP_H
+#define TASK_GROUP_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+#include "ThreadPool.h"
+
+// runs tasks on a ThreadPool and waits for all of them through a single
+// counter instead of one future per task
+template<class Pool = ThreadPool>
+class TaskGroup {
+public:
+    explicit TaskGroup(Pool& pool) : pool(pool) {}
+    ~TaskGroup() { wait_quietly(); }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    template<class F, class... Args>
+    void run(F&& f, Args&&... args);
+
+    // blocks until every task run so far has finished and rethrows the
+    // first exception one of them threw. a worker of the pool keeps
+    // running queued tasks while it waits instead of blocking.
+    void wait();
+
+private:
+    // finishes one task of group when destroyed, moved along with the task
+    struct Completion {
+        explicit Completion(TaskGroup* group) noexcept : group(group) {}
+        Completion(Completion&& other) noexcept
+            :   group(std::exchange(other.group, nullptr)), ran(other.ran) {}
+        ~Completion();
+
+        TaskGroup* group;
+        bool ran = false;
+    };
+
+    void fail(std::exception_ptr exception) noexcept;
+    void finish() noexcept;
+    void wait_quietly() noexcept;
+
+    Pool& pool;
+    std::atomic<size_t> outstanding{0};
+
+    // only the task that brings outstanding to zero takes the mutex, it
+    // also guards error
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::exception_ptr error;
+};
+
+template<class Pool>
+template<class F, class... Args>
+void TaskGroup<Pool>::run(F&& f, Args&&... args)
+{
+    ++outstanding;
+    // finishes the task even when the pool drops or cancels it unrun, the
+    // group then reports TaskCancelled
+    pool.post(
+        [completion = Completion(this),
+         f = std::forward<F>(f),
+         ...args = std::forward<Args>(args)]() mutable
+        {
+            try
+            {
+                std::invoke(std::move(f), std::move(args)...);
+            }
+            catch(...)
+            {
+                completion.group->fail(std::current_exception());
+            }
+            completion.ran = true;
+        }
+    );
+}
+
+template<class Pool>
+inline TaskGroup<Pool>::Completion::~Completion()
+{
+    if(!group)
+        return;
+    if(!ran)
+        group->fail(std::make_exception_ptr(TaskCancelled()));
+    group->finish();
+}
+
+template<class Pool>
+inline void TaskGroup<Pool>::fail(std::exception_ptr exception) noexcept
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(!error)
+        error = std::move(exception);
+}
+
+// the last task decrements under the mutex, so once a waiter has seen zero
+// and taken the mutex no task touches the group anymore
+template<class Pool>
+inline void TaskGroup<Pool>::finish() noexcept
+{
+    size_t count = outstanding.load(std::memory_order_relaxed);
+    while(count > 1)
+        if(outstanding.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+            return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if(--outstanding == 0)
+        condition.notify_all();
+}
+
+template<class Pool>
+inline void TaskGroup<Pool>::wait()
+{
+    wait_quietly();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if(error)
+        std::rethrow_exception(std::exchange(error, nullptr));
+}
+
+template<class Pool>
+inline void TaskGroup<Pool>::wait_quietly() noexcept
+{
+    while(outstanding != 0)
+        if(!pool.run_pending_task())
+            break;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this]{ return outstanding == 0; });
+}
+
+#endif
@@ -2,97 +2,1338 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
+#include <array>
+#include <chrono>
 #include <memory>
+#include <optional>
+#include <algorithm>
+#include <ranges>
+#include <concepts>
+#include <latch>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
-#include <future>
-#include <functional>
+#include <coroutine>
 #include <stdexcept>
+#include <stop_token>
+#include <tuple>
+#include <type_traits>
 
-class ThreadPool {
+#include "Future.h"
+#include "LockedQueue.h"
+#include "RingDeque.h"
+#include "Stats.h"
+#include "UniqueFunction.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// scheduling classes, workers always serve the highest non-empty lane first
+enum class Priority { high, normal, low };
+
+// what enqueue does with a task that doesn't fit into a bounded pool:
+// wait for room, discard it (its future reports TaskCancelled), run it
+// on the calling thread or throw
+enum class RejectPolicy { block, drop, caller_runs, throw_error };
+
+// how many workers a pool runs and how they idle
+struct ThreadPoolOptions {
+    // workers that are kept alive even when there is nothing to do
+    size_t min_threads = 1;
+    // the pool grows up to this many workers while tasks pile up
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    // how long a worker that ran out of tasks busy waits before parking
+    std::chrono::microseconds spin = std::chrono::microseconds(50);
+    // how long a parked worker above min_threads waits before it exits
+    std::chrono::milliseconds keep_alive = std::chrono::seconds(2);
+    // cpus the workers are pinned to, empty leaves them to the scheduler
+    std::vector<int> cpus;
+    // pin every worker to a single cpu of cpus instead of the whole set
+    bool pin_each_cpu = false;
+    // tasks the shared lanes and the deadline heap may hold, 0 is unbounded.
+    // tasks a worker enqueues are always admitted, a worker waiting for
+    // room would be waiting for itself.
+    size_t capacity = 0;
+    // what happens to tasks beyond capacity
+    RejectPolicy reject = RejectPolicy::block;
+
+    // exactly threads workers, everything else left at its default
+    static ThreadPoolOptions fixed(size_t threads)
+    {
+        ThreadPoolOptions options;
+        options.min_threads = options.max_threads = threads;
+        return options;
+    }
+};
+
+template<class Pool> class TaskGroup;
+
+// what a task enqueued with a stop_token returns, it gets the token as its
+// first argument if it takes one
+template<class F, class... Args>
+using stoppable_result_t =
+    typename std::conditional_t<std::invocable<F, std::stop_token, Args...>,
+                                std::invoke_result<F, std::stop_token, Args...>,
+                                std::invoke_result<F, Args...>>::type;
+
+// a work stealing thread pool. Queue is the policy for the shared lanes that
+// tasks from outside the pool go through, see LockedQueue.h for what a
+// policy provides. LockedQueue is the default, MpmcQueue and MpscQueue
+// take the lock off the producers' path.
+template<template<class> class Queue = LockedQueue>
+class BasicThreadPool {
 public:
-    ThreadPool(size_t);
+    using clock = std::chrono::steady_clock;
+
+    BasicThreadPool(size_t);
+    BasicThreadPool(const ThreadPoolOptions&);
+    template<class F, class... Args>
+        requires std::invocable<F, Args...>
+    auto enqueue(F&& f, Args&&... args)
+        -> Future<std::invoke_result_t<F, Args...>>;
+    template<class F, class... Args>
+    auto enqueue(Priority priority, F&& f, Args&&... args)
+        -> Future<std::invoke_result_t<F, Args...>>;
+    template<class F, class... Args>
+    auto enqueue(clock::time_point deadline, F&& f, Args&&... args)
+        -> Future<std::invoke_result_t<F, Args...>>;
+    template<class F, class... Args>
+    auto enqueue(std::stop_token token, F&& f, Args&&... args)
+        -> Future<stoppable_result_t<F, Args...>>;
+    template<class F, class... Args>
+        requires std::invocable<F, Args...>
+    auto try_enqueue(F&& f, Args&&... args)
+        -> std::optional< Future<std::invoke_result_t<F, Args...>> >;
+    template<class Rep, class Period, class F, class... Args>
+        requires std::invocable<F, Args...>
+    auto enqueue_for(const std::chrono::duration<Rep, Period>& timeout, F&& f, Args&&... args)
+        -> std::optional< Future<std::invoke_result_t<F, Args...>> >;
+    template<class F, class... Args>
+        requires std::invocable<F, Args...>
+    void post(F&& f, Args&&... args);
     template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) 
-        -> std::future<typename std::result_of<F(Args...)>::type>;
-    ~ThreadPool();
+    void post(Priority priority, F&& f, Args&&... args);
+    template<class Range>
+    auto enqueue_bulk(Range&& range)
+        -> std::vector< Future<std::invoke_result_t<std::ranges::range_reference_t<Range>>> >;
+    // co_await pool.schedule() continues the awaiting coroutine on a worker
+    struct schedule_awaiter {
+        BasicThreadPool& pool;
+        Priority priority;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const noexcept {}
+    };
+    schedule_awaiter schedule(Priority priority = Priority::normal) { return { *this, priority }; }
+    template<std::integral Index, class F>
+    void parallel_for(Index first, Index last, F&& f, size_t grain = 0);
+    template<std::integral Index, class T, class F, class Reduce>
+    T parallel_reduce(Index first, Index last, T identity, F&& f, Reduce&& reduce, size_t grain = 0);
+    // tasks waiting in a lane, the normal lane includes the worker deques
+    size_t queue_depth(Priority priority) const;
+    // tasks waiting with a deadline
+    size_t deadline_depth() const;
+    // workers currently running
+    size_t size() const;
+    // stops taking tasks and lets the workers finish the queued ones, false
+    // if they are still at it after timeout. the destructor does the same
+    // without a timeout.
+    bool shutdown_drain(clock::duration timeout = clock::duration::max());
+    // stops taking tasks, cancels the queued ones and asks the running ones
+    // to stop through get_stop_token(), false if some still run after timeout
+    bool shutdown_now(clock::duration timeout = clock::duration::max());
+    // stopped once shutdown_now is called, for long running tasks to poll
+    std::stop_token get_stop_token() const noexcept { return stopping.get_token(); }
+#ifdef THREAD_POOL_STATS
+    // a consistent enough copy of the counters, taken without stopping anyone
+    ThreadPoolStats stats() const;
+#endif
+    ~BasicThreadPool();
 private:
-    // need to keep track of threads so we can join them
+    template<class Pool> friend class TaskGroup;
+    static constexpr size_t lane_count = 3;
+    // a lane that has been passed over this many times is served next
+    static constexpr unsigned aging_limit = 16;
+    // deadline tasks this close to their deadline overtake every lane
+    static constexpr clock::duration deadline_slack = std::chrono::milliseconds(1);
+    // a worker looks at the shared lanes before its own deque every so often
+    static constexpr unsigned global_interval = 61;
+
+    // a task as it sits in a queue
+    struct queued_task {
+        UniqueFunction function;
+        [[no_unique_address]] EnqueueTime enqueued;
+    };
+    using lane_queue = Queue<queued_task>;
+    // slots per lane for bounded policies when the pool has no capacity
+    static constexpr size_t default_lane_capacity = 16384;
+
+    struct deadline_task {
+        clock::time_point deadline;
+        // keeps tasks with equal deadlines in FIFO order
+        unsigned long long sequence;
+        queued_task task;
+
+        // orders the heap with the earliest deadline on top
+        friend bool operator<(const deadline_task& a, const deadline_task& b)
+        {
+            return std::tie(b.deadline, b.sequence) < std::tie(a.deadline, a.sequence);
+        }
+    };
+
+    // every worker owns a deque: it pushes and pops at the back,
+    // idle workers steal from the front
+    struct worker_queue {
+        std::mutex mutex;
+        RingDeque<queued_task> tasks;
+        // only touched by the owning worker
+        unsigned pops = 0;
+        [[no_unique_address]] WorkerStats stats;
+        // whether a thread is running in this slot
+        std::atomic<bool> alive{false};
+    };
+
+    // the pool and index of the worker running on this thread, if any
+    struct worker_context {
+        BasicThreadPool* pool;
+        size_t index;
+    };
+    static inline thread_local worker_context current;
+
+    // a task's promise, destroying the task before it ran cancels it
+    template<class R>
+    struct task_promise {
+        explicit task_promise(Promise<R>&& promise) noexcept : promise(std::move(promise)) {}
+        task_promise(task_promise&&) noexcept = default;
+        ~task_promise() { promise.cancel(); }
+
+        Promise<R> promise;
+    };
+
+    template<class R, class F, class... Args>
+    static UniqueFunction package(Future<R>& res, F&& f, Args&&... args);
+    void push_task(UniqueFunction task);
+    void push_tasks(UniqueFunction* first, UniqueFunction* last);
+    void push_lane(Priority priority, UniqueFunction* first, UniqueFunction* last);
+    void push_deadline(clock::time_point deadline, UniqueFunction task);
+    size_t push_shared(Priority priority, std::optional<clock::time_point> deadline,
+                       UniqueFunction* first, UniqueFunction* last,
+                       RejectPolicy policy, clock::time_point until);
+    size_t reserve(size_t count, RejectPolicy policy);
+    void release(size_t count);
+    bool has_room(size_t lane, bool deadline) const;
+    bool wait_for_room(size_t lane, bool deadline, clock::time_point until);
+    bool pop_task(size_t index, queued_task& task);
+    bool pop_local(worker_queue& queue, queued_task& task);
+    bool pop_global(queued_task& task);
+    std::unique_lock<std::mutex> lock_queue();
+    bool global_waiting() const;
+    bool run_pending_task();
+    void worker_main(size_t index);
+    void pin_worker(size_t index);
+    bool spin(size_t index, queued_task& task);
+    bool retire();
+    bool try_spawn();
+    void notify_sleepers(size_t count);
+    void begin_stop();
+    bool wait_exited(clock::duration timeout);
+    void join_workers();
+    size_t cancel_queued();
+    template<std::integral Index, class Chunk>
+    void parallel_chunks(Index first, Index last, size_t grain, Chunk& chunk);
+
+    const ThreadPoolOptions options;
+
+    // need to keep track of threads so we can join them, there is a slot
+    // for max_threads workers and the ones not running are empty
     std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
-    
+    // the per worker queues, indexed like workers
+    std::vector< std::unique_ptr<worker_queue> > queues;
+    // guards starting threads in and joining threads from the slots
+    std::mutex spawn_mutex;
+    // the shared lanes, normal is also where tasks enqueued from outside
+    // the pool without a priority end up, synchronized by the policy
+    std::array< lane_queue, lane_count > lanes;
+    // a heap of the tasks with a deadline, guarded by queue_mutex
+    std::vector< deadline_task > deadlines;
+    unsigned long long deadline_sequence = 0;
+    // how often each lane has been passed over while it had tasks. bumped
+    // without a lock by whoever pops, a lost bump only delays aging a little
+    std::array< std::atomic<unsigned>, lane_count > passed_over{};
+    // lock free view of the shared lanes' and the deadline heap's sizes, a
+    // lane's depth is raised before its tasks become visible
+    std::array< std::atomic<size_t>, lane_count > lane_depth{};
+    std::atomic<size_t> deadline_count{0};
+    // tasks counted against capacity, only kept when there is one
+    std::atomic<size_t> shared_size{0};
+
     // synchronization
     std::mutex queue_mutex;
     std::condition_variable condition;
-    bool stop;
+    // notified by the last worker leaving a stopped pool
+    std::condition_variable exited;
+    // producers waiting for room in a bounded pool or lane
+    std::condition_variable space_condition;
+    std::atomic<size_t> blocked_producers{0};
+    // tasks sitting in any queue, workers busy waiting for one, workers
+    // blocked on condition and workers running at all
+    std::atomic<size_t> pending;
+    std::atomic<size_t> spinning;
+    std::atomic<size_t> sleeping;
+    std::atomic<size_t> running;
+    std::atomic<bool> stop;
+    std::stop_source stopping;
+
+    [[no_unique_address]] PoolStats pool_stats;
 };
- 
+
+// lets the other hyperthread of the core run while busy waiting
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads)
-    :   stop(false)
+template<template<class> class Queue>
+inline BasicThreadPool<Queue>::BasicThreadPool(size_t threads)
+    :   BasicThreadPool(ThreadPoolOptions::fixed(threads))
 {
-    for(size_t i = 0;i<threads;++i)
-        workers.emplace_back(
-            [this]
+}
+
+// starts min_threads workers, more are started on demand
+template<template<class> class Queue>
+inline BasicThreadPool<Queue>::BasicThreadPool(const ThreadPoolOptions& options)
+    :   options(options),
+        lanes{ lane_queue(options.capacity ? options.capacity : default_lane_capacity),
+               lane_queue(options.capacity ? options.capacity : default_lane_capacity),
+               lane_queue(options.capacity ? options.capacity : default_lane_capacity) },
+        pending(0), spinning(0), sleeping(0), running(0), stop(false)
+{
+    if(options.max_threads == 0 || options.min_threads > options.max_threads)
+        throw std::invalid_argument("ThreadPool needs 0 <= min_threads <= max_threads, 0 < max_threads");
+
+    workers.resize(options.max_threads);
+    for(size_t i = 0;i<options.max_threads;++i)
+        queues.emplace_back(new worker_queue);
+
+    for(size_t i = 0;i<options.min_threads;++i)
+        try_spawn();
+}
+
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::worker_main(size_t index)
+{
+    current = { this, index };
+    pin_worker(index);
+
+    worker_queue& queue = *queues[index];
+
+    for(;;)
+    {
+        queued_task task;
+
+        if(pop_task(index, task) || spin(index, task))
+        {
+            // hand a backlog on to one more parked worker
+            if(pending != 0 && sleeping != 0)
+                notify_sleepers(1);
+
+            WorkerStats::Run run(queue.stats, task.enqueued);
+            task.function();
+            continue;
+        }
+
+        queue.stats.on_park();
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        ++sleeping;
+        auto ready = [this]{ return stop || pending != 0; };
+        bool woken = true;
+        if(options.min_threads == options.max_threads)
+            condition.wait(lock, ready);
+        else
+            woken = condition.wait_for(lock, options.keep_alive, ready);
+        --sleeping;
+
+        if(stop && pending == 0)
+        {
+            if(--running == 0)
+                exited.notify_all();
+            break;
+        }
+        if(!woken && retire())
+            break;
+    }
+    queues[index]->alive = false;
+}
+
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::pin_worker(size_t index)
+{
+#ifdef __linux__
+    if(options.cpus.empty())
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(options.pin_each_cpu)
+        CPU_SET(options.cpus[index % options.cpus.size()], &set);
+    else
+        for(int cpu: options.cpus)
+            CPU_SET(cpu, &set);
+
+    // a set outside of the process' affinity leaves the worker unpinned
+    ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+#else
+    (void)index;
+#endif
+}
+
+// busy waits a little before parking, so a burst of tasks doesn't pay for a
+// futex wake per task. at most half of the workers spin at any time.
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::spin(size_t index, queued_task& task)
+{
+    if(options.spin.count() == 0 || 2 * spinning >= running)
+        return false;
+
+    ++spinning;
+    const auto until = clock::now() + options.spin;
+    bool found = false;
+    for(unsigned i = 1; !stop; ++i)
+    {
+        if(pending != 0 && pop_task(index, task))
+        {
+            queues[index]->stats.on_spin_hit();
+            found = true;
+            break;
+        }
+        if(i % 64 == 0)
+        {
+            if(clock::now() >= until)
+                break;
+            std::this_thread::yield();
+        }
+        cpu_relax();
+    }
+
+    // pushes skip the wakeup while somebody spins, so the last spinner to
+    // find work passes the rest of a burst on
+    if(--spinning == 0 && found && pending != 0)
+        notify_sleepers(1);
+    return found;
+}
+
+// a worker that has been idle for keep_alive exits while the pool is above
+// min_threads, called with queue_mutex held
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::retire()
+{
+    if(pending != 0)
+        return false;
+
+    size_t count = running;
+    do
+    {
+        if(count <= options.min_threads)
+            return false;
+    }
+    while(!running.compare_exchange_weak(count, count - 1));
+    return true;
+}
+
+// starts a worker in a free slot unless the pool is stopped or full
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::try_spawn()
+{
+    std::unique_lock<std::mutex> lock(spawn_mutex);
+    if(stop || running >= options.max_threads)
+        return false;
+
+    for(size_t i = 0; i < workers.size(); ++i)
+    {
+        if(queues[i]->alive)
+            continue;
+
+        // a worker that retired from this slot may still be on its way out
+        if(workers[i].joinable())
+            workers[i].join();
+
+        queues[i]->alive = true;
+        ++running;
+        workers[i] = std::thread(&BasicThreadPool::worker_main, this, i);
+        return true;
+    }
+    return false;
+}
+
+// wraps f(args...) into a task that fulfils res, the promise and the
+// callable live inside the task itself so small callables don't allocate
+template<template<class> class Queue>
+template<class R, class F, class... Args>
+UniqueFunction BasicThreadPool<Queue>::package(Future<R>& res, F&& f, Args&&... args)
+{
+    Promise<R> promise;
+    res = promise.get_future();
+
+    return
+        [task = task_promise<R>(std::move(promise)),
+         f = std::forward<F>(f),
+         ...args = std::forward<Args>(args)]() mutable
+        {
+            task.promise.set_result(std::move(f), std::move(args)...);
+        };
+}
+
+// add new work item to the pool
+template<template<class> class Queue>
+template<class F, class... Args>
+    requires std::invocable<F, Args...>
+auto BasicThreadPool<Queue>::enqueue(F&& f, Args&&... args)
+    -> Future<std::invoke_result_t<F, Args...>>
+{
+    Future<std::invoke_result_t<F, Args...>> res;
+    push_task(package(res, std::forward<F>(f), std::forward<Args>(args)...));
+    return res;
+}
+
+// add new work item to one of the shared lanes
+template<template<class> class Queue>
+template<class F, class... Args>
+auto BasicThreadPool<Queue>::enqueue(Priority priority, F&& f, Args&&... args)
+    -> Future<std::invoke_result_t<F, Args...>>
+{
+    Future<std::invoke_result_t<F, Args...>> res;
+    UniqueFunction task = package(res, std::forward<F>(f), std::forward<Args>(args)...);
+    push_lane(priority, &task, &task + 1);
+    return res;
+}
+
+// add new work item that should start before deadline, deadline tasks are
+// served earliest deadline first, after the high lane until they get close
+template<template<class> class Queue>
+template<class F, class... Args>
+auto BasicThreadPool<Queue>::enqueue(clock::time_point deadline, F&& f, Args&&... args)
+    -> Future<std::invoke_result_t<F, Args...>>
+{
+    Future<std::invoke_result_t<F, Args...>> res;
+    push_deadline(deadline, package(res, std::forward<F>(f), std::forward<Args>(args)...));
+    return res;
+}
+
+// add new work item that is cancelled instead of started once token is
+// stopped, f can take the token as its first argument to stop midway
+template<template<class> class Queue>
+template<class F, class... Args>
+auto BasicThreadPool<Queue>::enqueue(std::stop_token token, F&& f, Args&&... args)
+    -> Future<stoppable_result_t<F, Args...>>
+{
+    using return_type = stoppable_result_t<F, Args...>;
+
+    Promise<return_type> promise;
+    Future<return_type> res = promise.get_future();
+    push_task(
+        [task = task_promise<return_type>(std::move(promise)),
+         token = std::move(token),
+         f = std::forward<F>(f),
+         ...args = std::forward<Args>(args)]() mutable
+        {
+            if(token.stop_requested())
+                return task.promise.cancel();
+            if constexpr(std::invocable<F, std::stop_token, Args...>)
+                task.promise.set_result(std::move(f), std::move(token), std::move(args)...);
+            else
+                task.promise.set_result(std::move(f), std::move(args)...);
+        }
+    );
+    return res;
+}
+
+// add new work item unless the pool is at capacity
+template<template<class> class Queue>
+template<class F, class... Args>
+    requires std::invocable<F, Args...>
+auto BasicThreadPool<Queue>::try_enqueue(F&& f, Args&&... args)
+    -> std::optional< Future<std::invoke_result_t<F, Args...>> >
+{
+    return enqueue_for(clock::duration::zero(), std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// add new work item, waiting up to timeout for room in a bounded pool
+template<template<class> class Queue>
+template<class Rep, class Period, class F, class... Args>
+    requires std::invocable<F, Args...>
+auto BasicThreadPool<Queue>::enqueue_for(const std::chrono::duration<Rep, Period>& timeout, F&& f, Args&&... args)
+    -> std::optional< Future<std::invoke_result_t<F, Args...>> >
+{
+    Future<std::invoke_result_t<F, Args...>> res;
+    UniqueFunction task = package(res, std::forward<F>(f), std::forward<Args>(args)...);
+
+    if(current.pool == this)
+        push_task(std::move(task));
+    else if(push_shared(Priority::normal, std::nullopt, &task, &task + 1, RejectPolicy::block,
+                        clock::now() + std::chrono::ceil<clock::duration>(timeout)) == 0)
+        return std::nullopt;
+    return res;
+}
+
+// a resumption is never rejected, a dropped handle would leak the whole
+// coroutine frame, so a bounded pool always blocks for it. resuming from a
+// worker at normal priority stays on the worker's own deque.
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::schedule_awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    UniqueFunction task([handle]{ handle.resume(); });
+    if(current.pool == &pool && priority == Priority::normal)
+        pool.push_task(std::move(task));
+    else
+        pool.push_shared(priority, std::nullopt, &task, &task + 1,
+                         RejectPolicy::block, clock::time_point::max());
+}
+
+// add new work item without a future, an exception escaping f ends the
+// program just like it would on a plain std::thread
+template<template<class> class Queue>
+template<class F, class... Args>
+    requires std::invocable<F, Args...>
+void BasicThreadPool<Queue>::post(F&& f, Args&&... args)
+{
+    push_task(
+        [f = std::forward<F>(f),
+         ...args = std::forward<Args>(args)]() mutable noexcept
+        {
+            std::invoke(std::move(f), std::move(args)...);
+        }
+    );
+}
+
+template<template<class> class Queue>
+template<class F, class... Args>
+void BasicThreadPool<Queue>::post(Priority priority, F&& f, Args&&... args)
+{
+    UniqueFunction task =
+        [f = std::forward<F>(f),
+         ...args = std::forward<Args>(args)]() mutable noexcept
+        {
+            std::invoke(std::move(f), std::move(args)...);
+        };
+    push_lane(priority, &task, &task + 1);
+}
+
+// add a whole batch of work items, they are published under a single lock.
+// the callables are copied out of the range unless it yields rvalues
+template<template<class> class Queue>
+template<class Range>
+auto BasicThreadPool<Queue>::enqueue_bulk(Range&& range)
+    -> std::vector< Future<std::invoke_result_t<std::ranges::range_reference_t<Range>>> >
+{
+    using return_type = std::invoke_result_t<std::ranges::range_reference_t<Range>>;
+
+    std::vector< Future<return_type> > res;
+    std::vector< UniqueFunction > batch;
+    if constexpr(std::ranges::sized_range<Range>)
+    {
+        res.reserve(std::ranges::size(range));
+        batch.reserve(std::ranges::size(range));
+    }
+
+    for(auto&& f: range)
+        batch.push_back(package(res.emplace_back(), std::forward<decltype(f)>(f)));
+
+    push_tasks(std::data(batch), std::data(batch) + std::size(batch));
+    return res;
+}
+
+// calls f(i) for every i in [first, last) and returns once all calls are done,
+// the calling thread works through chunks alongside the workers
+template<template<class> class Queue>
+template<std::integral Index, class F>
+void BasicThreadPool<Queue>::parallel_for(Index first, Index last, F&& f, size_t grain)
+{
+    auto chunk = [&f](Index begin, Index end)
+    {
+        for(Index i = begin; i != end; ++i)
+            f(i);
+    };
+    parallel_chunks(first, last, grain, chunk);
+}
+
+// folds f(i) for every i in [first, last) into identity with reduce,
+// reduce has to be associative and commutative as chunks finish in any order
+template<template<class> class Queue>
+template<std::integral Index, class T, class F, class Reduce>
+T BasicThreadPool<Queue>::parallel_reduce(Index first, Index last, T identity, F&& f, Reduce&& reduce, size_t grain)
+{
+    T result = identity;
+    std::mutex result_mutex;
+
+    auto chunk = [&](Index begin, Index end)
+    {
+        T partial = identity;
+        for(Index i = begin; i != end; ++i)
+            partial = reduce(std::move(partial), f(i));
+
+        std::unique_lock<std::mutex> lock(result_mutex);
+        result = reduce(std::move(result), std::move(partial));
+    };
+    parallel_chunks(first, last, grain, chunk);
+    return result;
+}
+
+// splits [first, last) into contiguous chunks handed out by guided
+// self-scheduling: every claim takes a share of what is left but at least
+// grain indices, so chunks start big and shrink toward the end to balance
+// the load. completion is tracked by one latch counting indices.
+template<template<class> class Queue>
+template<std::integral Index, class Chunk>
+void BasicThreadPool<Queue>::parallel_chunks(Index first, Index last, size_t grain, Chunk& chunk)
+{
+    if(!(first < last))
+        return;
+
+    struct state {
+        state(Index first, size_t count, size_t grain, size_t participants, Chunk& chunk)
+            :   first(first), count(count), grain(grain), participants(participants),
+                next(0), done(static_cast<std::ptrdiff_t>(count)), chunk(chunk) {}
+
+        void run()
+        {
+            for(;;)
             {
-                for(;;)
+                size_t begin = next.load(std::memory_order_relaxed);
+                size_t size;
+                do
                 {
-                    std::function<void()> task;
+                    if(begin >= count)
+                        return;
+                    size = std::min(count - begin,
+                                    std::max(grain, (count - begin) / (2 * participants)));
+                }
+                while(!next.compare_exchange_weak(begin, begin + size, std::memory_order_relaxed));
 
+                if(!failed.load(std::memory_order_relaxed))
+                {
+                    try
                     {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock,
-                            [this]{ return this->stop || !this->tasks.empty(); });
-                        if(this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
+                        chunk(static_cast<Index>(first + begin),
+                              static_cast<Index>(first + begin + size));
+                    }
+                    catch(...)
+                    {
+                        std::unique_lock<std::mutex> lock(error_mutex);
+                        if(!error)
+                            error = std::current_exception();
+                        failed = true;
                     }
-
-                    task();
                 }
+                done.count_down(static_cast<std::ptrdiff_t>(size));
             }
-        );
+        }
+
+        const Index first;
+        const size_t count;
+        const size_t grain;
+        const size_t participants;
+        std::atomic<size_t> next;
+        std::latch done;
+        // only touched while a chunk is claimed, which keeps the caller waiting
+        Chunk& chunk;
+
+        std::atomic<bool> failed{false};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    const size_t count = static_cast<size_t>(last - first);
+    if(grain == 0)
+        grain = std::max<size_t>(1, count / (64 * (size() + 1)));
+    const size_t participants = std::min(size() + 1, (count + grain - 1) / grain);
+
+    // helpers that start after the range is used up just drop their reference
+    auto s = std::make_shared<state>(first, count, grain, participants, chunk);
+    std::vector< UniqueFunction > helpers;
+    helpers.reserve(participants - 1);
+    for(size_t i = 1; i < participants; ++i)
+        helpers.emplace_back([s]{ s->run(); });
+    // helpers are optional, the caller runs whatever they don't get to. so
+    // from outside the pool the ones that don't fit into a bounded pool are
+    // dropped, the reject policy is for tasks that have to run
+    if(current.pool == this)
+        push_tasks(std::data(helpers), std::data(helpers) + std::size(helpers));
+    else
+        push_shared(Priority::normal, std::nullopt, std::data(helpers), std::data(helpers) + std::size(helpers),
+                    RejectPolicy::drop, clock::time_point::max());
+
+    s->run();
+    s->done.wait();
+    if(s->error)
+        std::rethrow_exception(s->error);
 }
 
-// add new work item to the pool
-template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) 
-    -> std::future<typename std::result_of<F(Args...)>::type>
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::push_task(UniqueFunction task)
+{
+    push_tasks(&task, &task + 1);
+}
+
+// tasks enqueued by a worker of this pool go onto its own deque,
+// everything else goes through the normal lane
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::push_tasks(UniqueFunction* first, UniqueFunction* last)
 {
-    using return_type = typename std::result_of<F(Args...)>::type;
+    if(current.pool != this)
+        return push_lane(Priority::normal, first, last);
+
+    const size_t count = static_cast<size_t>(last - first);
+    if(count == 0)
+        return;
+
+    // don't allow enqueueing after stopping the pool
+    if(stop)
+        throw std::runtime_error("enqueue on stopped ThreadPool");
 
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-        );
-        
-    std::future<return_type> res = task->get_future();
+    const EnqueueTime enqueued = EnqueueTime::now();
+    worker_queue& queue = *queues[current.index];
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        for(; first != last; ++first)
+            queue.tasks.push_back({ std::move(*first), enqueued });
+    }
+    pending += count;
+    pool_stats.on_submit(count);
+    notify_sleepers(count);
+}
 
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::push_lane(Priority priority, UniqueFunction* first, UniqueFunction* last)
+{
+    push_shared(priority, std::nullopt, first, last, options.reject, clock::time_point::max());
+}
+
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::push_deadline(clock::time_point deadline, UniqueFunction task)
+{
+    push_shared(Priority::normal, deadline, &task, &task + 1, options.reject, clock::time_point::max());
+}
+
+// queues tasks on a shared lane or, given a deadline, on the deadline heap.
+// tasks that don't fit, beyond capacity or into a full bounded lane, are
+// handled by policy: block waits for room until until and rejects the rest
+// after that. rejected tasks are run on the calling thread for caller_runs
+// and destroyed otherwise. a worker of the pool is never refused, it runs
+// what doesn't fit into a full lane itself. returns how many were queued.
+template<template<class> class Queue>
+inline size_t BasicThreadPool<Queue>::push_shared(Priority priority, std::optional<clock::time_point> deadline,
+                                                  UniqueFunction* first, UniqueFunction* last,
+                                                  RejectPolicy policy, clock::time_point until)
+{
+    const size_t lane = static_cast<size_t>(priority);
+    const bool worker = current.pool == this;
+    size_t queued = 0;
+
+    while(first != last)
+    {
         // don't allow enqueueing after stopping the pool
         if(stop)
             throw std::runtime_error("enqueue on stopped ThreadPool");
 
-        tasks.emplace([task](){ (*task)(); });
+        const size_t count = reserve(static_cast<size_t>(last - first), policy);
+        const EnqueueTime enqueued = EnqueueTime::now();
+        size_t pushed = 0;
+        if(count != 0 && deadline)
+        {
+            std::unique_lock<std::mutex> lock = lock_queue();
+            if(stop)
+            {
+                lock.unlock();
+                release(count);
+                throw std::runtime_error("enqueue on stopped ThreadPool");
+            }
+            for(; pushed < count; ++pushed)
+            {
+                deadlines.push_back({ *deadline, deadline_sequence++, { std::move(first[pushed]), enqueued } });
+                std::push_heap(deadlines.begin(), deadlines.end());
+            }
+            deadline_count += count;
+            pending += count;
+        }
+        else if(count != 0)
+        {
+            // counted before the tasks are visible, a worker that takes one
+            // right away must not drive the counters below zero
+            lane_depth[lane] += count;
+            pending += count;
+            for(; pushed < count; ++pushed)
+            {
+                queued_task item{ std::move(first[pushed]), enqueued };
+                if(!lanes[lane].try_push(item))
+                {
+                    first[pushed] = std::move(item.function);
+                    break;
+                }
+            }
+            lane_depth[lane] -= count - pushed;
+            pending -= count - pushed;
+            release(count - pushed);
+        }
+
+        first += pushed;
+        queued += pushed;
+        if(pushed != 0)
+        {
+            pool_stats.on_submit(pushed);
+            notify_sleepers(pushed);
+        }
+
+        if(first == last || worker)
+            break;
+        if(policy == RejectPolicy::throw_error)
+            throw std::runtime_error("ThreadPool queue is full");
+        if(policy != RejectPolicy::block || !wait_for_room(lane, deadline.has_value(), until))
+            break;
     }
-    condition.notify_one();
-    return res;
+
+    for(; first != last; ++first)
+    {
+        if(worker || policy == RejectPolicy::caller_runs)
+            (*first)();
+        *first = UniqueFunction();
+    }
+    return queued;
+}
+
+// takes up to count tasks' worth of capacity, for throw_error all of count
+// or nothing. workers of the pool take it without looking, a worker waiting
+// for room would be waiting for itself.
+template<template<class> class Queue>
+inline size_t BasicThreadPool<Queue>::reserve(size_t count, RejectPolicy policy)
+{
+    if(options.capacity == 0)
+        return count;
+    if(current.pool == this)
+    {
+        shared_size += count;
+        return count;
+    }
+
+    size_t used = shared_size.load(std::memory_order_relaxed);
+    size_t taken;
+    do
+    {
+        const size_t room = used < options.capacity ? options.capacity - used : 0;
+        taken = std::min(count, room);
+        if(taken == 0 || (policy == RejectPolicy::throw_error && taken < count))
+            return 0;
+    }
+    while(!shared_size.compare_exchange_weak(used, used + taken));
+    return taken;
+}
+
+// gives back capacity after a pop or a failed push and wakes producers
+// waiting for room. blocked_producers is read after shared_size is written
+// and written before shared_size is read in wait_for_room, so either the
+// producer sees the room or this sees the producer.
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::release(size_t count)
+{
+    if(count == 0)
+        return;
+    if(options.capacity != 0)
+        shared_size -= count;
+
+    if(blocked_producers != 0)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+        }
+        if(count == 1)
+            space_condition.notify_one();
+        else
+            space_condition.notify_all();
+    }
+}
+
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::has_room(size_t lane, bool deadline) const
+{
+    if(options.capacity != 0 && shared_size >= options.capacity)
+        return false;
+    return deadline || lane_depth[lane] < lanes[lane].capacity();
+}
+
+// parks a producer until there is room or until passes, false on timeout.
+// whether a bounded lane has room is only known for sure by pushing, so the
+// wait is cut short every millisecond to try again.
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::wait_for_room(size_t lane, bool deadline, clock::time_point until)
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    ++blocked_producers;
+    const auto retry = clock::now() + std::chrono::milliseconds(1);
+    space_condition.wait_until(lock, std::min(until, retry),
+                               [&]{ return stop || has_room(lane, deadline); });
+    --blocked_producers;
+
+    if(stop)
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+    return clock::now() < until || has_room(lane, deadline);
+}
+
+// only pay for the lock and the futex wake when somebody is actually asleep,
+// pending is always published before sleeping is read and the other way round
+// in the worker, so at least one side sees the other. a spinning worker picks
+// the task up by itself, and with everybody busy the pool grows once the
+// backlog outnumbers the workers.
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::notify_sleepers(size_t count)
+{
+    if(spinning != 0 && count == 1)
+        return;
+
+    if(sleeping == 0)
+    {
+        if(pending > running)
+            try_spawn();
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+    }
+    if(count == 1)
+        condition.notify_one();
+    else
+        condition.notify_all();
+}
+
+// whether the shared lanes hold something that should go before the
+// worker deques: high priority or deadline tasks
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::global_waiting() const
+{
+    return lane_depth[static_cast<size_t>(Priority::high)] != 0 || deadline_count != 0;
+}
+
+// own deque first (newest task, still hot in cache), then the shared
+// lanes, then steal the oldest task of the other workers. the shared lanes
+// go first while they hold urgent work and every global_interval pops, so
+// a worker busy with its own deque can't starve them.
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::pop_task(size_t index, queued_task& task)
+{
+    if(pending == 0)
+        return false;
+
+    worker_queue& queue = *queues[index];
+    if(++queue.pops % global_interval == 0 || global_waiting())
+    {
+        if(pop_global(task) || pop_local(queue, task))
+            return true;
+    }
+    else if(pop_local(queue, task) || pop_global(task))
+        return true;
+
+    for(size_t i = 1; i < queues.size(); ++i)
+    {
+        worker_queue& victim = *queues[(index + i) % queues.size()];
+        std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+        if(!lock)
+        {
+            queue.stats.on_steal_miss();
+            continue;
+        }
+        if(!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --pending;
+            queue.stats.on_stolen();
+            return true;
+        }
+    }
+    return false;
+}
+
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::pop_local(worker_queue& queue, queued_task& task)
+{
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    if(queue.tasks.empty())
+        return false;
+
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    --pending;
+    queue.stats.on_local();
+    return true;
+}
+
+// takes queue_mutex, counting the times it was already taken
+template<template<class> class Queue>
+inline std::unique_lock<std::mutex> BasicThreadPool<Queue>::lock_queue()
+{
+#ifdef THREAD_POOL_STATS
+    std::unique_lock<std::mutex> lock(queue_mutex, std::try_to_lock);
+    if(!lock)
+    {
+        pool_stats.on_contention();
+        lock.lock();
+    }
+    return lock;
+#else
+    return std::unique_lock<std::mutex>(queue_mutex);
+#endif
+}
+
+// picks from the shared lanes: deadline tasks close to their deadline,
+// then any lane that has been passed over aging_limit times, then the
+// lanes from high to low with the remaining deadline tasks after high.
+// queue_mutex is only taken while there are deadline tasks, or for every
+// pop when the lane policy allows just one consumer at a time.
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::pop_global(queued_task& task)
+{
+    std::unique_lock<std::mutex> lock;
+    if(!lane_queue::multi_consumer || deadline_count != 0)
+        lock = lock_queue();
+    const bool heap = lock.owns_lock() && !deadlines.empty();
+
+    auto take_deadline = [&]
+    {
+        std::pop_heap(deadlines.begin(), deadlines.end());
+        task = std::move(deadlines.back().task);
+        deadlines.pop_back();
+        --deadline_count;
+        --pending;
+        return true;
+    };
+
+    auto take_lane = [&](size_t lane)
+    {
+        if(lane_depth[lane] == 0 || !lanes[lane].try_pop(task))
+            return false;
+
+        for(size_t lower = lane + 1; lower < lane_count; ++lower)
+            if(lane_depth[lower] != 0)
+                passed_over[lower].store(passed_over[lower].load(std::memory_order_relaxed) + 1,
+                                         std::memory_order_relaxed);
+        passed_over[lane].store(0, std::memory_order_relaxed);
+
+        --lane_depth[lane];
+        --pending;
+        return true;
+    };
+
+    auto pick = [&]
+    {
+        if(heap && deadlines.front().deadline <= clock::now() + deadline_slack)
+            return take_deadline();
+
+        for(size_t lane = lane_count; lane-- > 1;)
+            if(passed_over[lane].load(std::memory_order_relaxed) >= aging_limit && take_lane(lane))
+                return true;
+
+        if(take_lane(0))
+            return true;
+        if(heap)
+            return take_deadline();
+        for(size_t lane = 1; lane < lane_count; ++lane)
+            if(take_lane(lane))
+                return true;
+        return false;
+    };
+
+    if(!pick())
+        return false;
+    if(lock)
+        lock.unlock();
+    release(1);
+    queues[current.index]->stats.on_global();
+    return true;
+}
+
+// lets a worker of this pool that waits for other tasks run one of them
+// instead of blocking, returns false when there was nothing to run
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::run_pending_task()
+{
+    if(current.pool != this)
+        return false;
+
+    queued_task task;
+    if(!pop_task(current.index, task))
+        return false;
+
+    WorkerStats::Run run(queues[current.index]->stats, task.enqueued);
+    task.function();
+    return true;
+}
+
+template<template<class> class Queue>
+inline size_t BasicThreadPool<Queue>::queue_depth(Priority priority) const
+{
+    if(priority != Priority::normal)
+        return lane_depth[static_cast<size_t>(priority)];
+
+    // pending covers every queue, the other counters are subtracted
+    // one by one so a concurrent pop may leave this slightly off
+    size_t others = lane_depth[static_cast<size_t>(Priority::high)]
+                  + lane_depth[static_cast<size_t>(Priority::low)]
+                  + deadline_count;
+    size_t total = pending;
+    return total > others ? total - others : 0;
+}
+
+template<template<class> class Queue>
+inline size_t BasicThreadPool<Queue>::deadline_depth() const
+{
+    return deadline_count;
+}
+
+template<template<class> class Queue>
+inline size_t BasicThreadPool<Queue>::size() const
+{
+    return running;
+}
+
+#ifdef THREAD_POOL_STATS
+template<template<class> class Queue>
+inline ThreadPoolStats BasicThreadPool<Queue>::stats() const
+{
+    ThreadPoolStats snapshot;
+    snapshot.submitted = pool_stats.submit_count();
+    snapshot.contended = pool_stats.contention_count();
+    snapshot.queued = pending;
+    for(size_t lane = 0; lane < lane_count; ++lane)
+        snapshot.lanes[lane] = queue_depth(static_cast<Priority>(lane));
+    snapshot.deadlines = deadline_depth();
+    snapshot.threads = size();
+    for(const auto& queue: queues)
+        snapshot.workers.push_back(queue->stats.snapshot());
+    return snapshot;
+}
+#endif
+
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::shutdown_drain(clock::duration timeout)
+{
+    begin_stop();
+    if(!wait_exited(timeout))
+        return false;
+    join_workers();
+    return true;
 }
 
-// the destructor joins all threads
-inline ThreadPool::~ThreadPool()
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::shutdown_now(clock::duration timeout)
+{
+    begin_stop();
+    stopping.request_stop();
+    cancel_queued();
+    if(!wait_exited(timeout))
+        return false;
+    join_workers();
+    return true;
+}
+
+// refuses new tasks from here on and wakes everybody, so parked workers run
+// what is left and exit and blocked producers give up
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::begin_stop()
 {
     {
         std::unique_lock<std::mutex> lock(queue_mutex);
         stop = true;
     }
     condition.notify_all();
-    for(std::thread &worker: workers)
+    space_condition.notify_all();
+}
+
+template<template<class> class Queue>
+inline bool BasicThreadPool<Queue>::wait_exited(clock::duration timeout)
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    auto done = [this]{ return running == 0; };
+    if(timeout == clock::duration::max())
+    {
+        exited.wait(lock, done);
+        return true;
+    }
+    return exited.wait_for(lock, timeout, done);
+}
+
+template<template<class> class Queue>
+inline void BasicThreadPool<Queue>::join_workers()
+{
+    // let a spawn that is already underway finish, later ones see stop. the
+    // threads are joined after letting go of spawn_mutex: a worker that got
+    // past the stop check in push_tasks may still call try_spawn, which
+    // would wait for the mutex while we wait for the worker.
+    std::vector< std::thread > exiting;
+    {
+        std::unique_lock<std::mutex> lock(spawn_mutex);
+        for(std::thread &worker: workers)
+            if(worker.joinable())
+                exiting.push_back(std::move(worker));
+    }
+    for(std::thread &worker: exiting)
         worker.join();
 }
 
+// takes every task that hasn't started out of the queues and destroys it,
+// which cancels its future. the tasks are destroyed after the locks are let
+// go, a continuation cancelled with them may call back into the pool.
+template<template<class> class Queue>
+inline size_t BasicThreadPool<Queue>::cancel_queued()
+{
+    std::vector<queued_task> cancelled;
+    queued_task task;
+    size_t shared = 0;
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        for(size_t lane = 0; lane < lane_count; ++lane)
+            while(lanes[lane].try_pop(task))
+            {
+                cancelled.push_back(std::move(task));
+                --lane_depth[lane];
+            }
+        for(deadline_task& waiting: deadlines)
+            cancelled.push_back(std::move(waiting.task));
+        deadline_count -= deadlines.size();
+        deadlines.clear();
+        shared = cancelled.size();
+
+        for(const auto& queue: queues)
+        {
+            std::unique_lock<std::mutex> queue_lock(queue->mutex);
+            for(; !queue->tasks.empty(); queue->tasks.pop_front())
+                cancelled.push_back(std::move(queue->tasks.front()));
+        }
+        pending -= cancelled.size();
+    }
+    release(shared);
+    condition.notify_all();
+
+    const size_t count = cancelled.size();
+    cancelled.clear();
+    return count;
+}
+
+// the destructor runs what is queued and joins all threads
+template<template<class> class Queue>
+inline BasicThreadPool<Queue>::~BasicThreadPool()
+{
+    begin_stop();
+    join_workers();
+}
+
+using ThreadPool = BasicThreadPool<>;
+
 #endif
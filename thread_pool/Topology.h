@@ -0,0 +1,101 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sched.h>
+
+// the cpus of one NUMA node that this process is allowed to run on
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
+
+// cpus this process may run on, from sched_getaffinity. empty if that
+// fails, for instance on hosts with more cpus than a cpu_set_t holds
+inline std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(::sched_getaffinity(0, sizeof(set), &set) == 0)
+        for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if(CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+    return cpus;
+}
+
+// parses a kernel cpu list such as "0-3,8,10-11"
+inline std::vector<int> parse_cpu_list(std::string_view list)
+{
+    std::vector<int> cpus;
+
+    while(!list.empty())
+    {
+        std::string_view item = list.substr(0, list.find(','));
+        list.remove_prefix(std::min(list.size(), item.size() + 1));
+
+        int first = 0;
+        int last = 0;
+        auto [end, error] = std::from_chars(item.data(), item.data() + item.size(), first);
+        if(error != std::errc())
+            continue;
+        last = first;
+        if(end != item.data() + item.size() && *end == '-')
+            std::from_chars(end + 1, item.data() + item.size(), last);
+
+        for(int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// the NUMA nodes from /sys/devices/system/node restricted to the allowed
+// cpus, a machine without that directory, or whose allowed cpus are
+// unknown, is reported as a single node 0, without cpus in the latter case
+inline std::vector<NumaNode> numa_nodes()
+{
+    const std::vector<int> allowed = allowed_cpus();
+    std::vector<NumaNode> nodes;
+
+    std::error_code error;
+    for(const auto& entry: std::filesystem::directory_iterator("/sys/devices/system/node", error))
+    {
+        const std::string name = entry.path().filename().string();
+        if(name.size() <= 4 || name.compare(0, 4, "node") != 0)
+            continue;
+
+        int id = 0;
+        auto [end, parse_error] = std::from_chars(name.data() + 4, name.data() + name.size(), id);
+        if(parse_error != std::errc() || end != name.data() + name.size())
+            continue;
+
+        std::ifstream file(entry.path() / "cpulist");
+        std::string list;
+        if(!std::getline(file, list))
+            continue;
+
+        NumaNode node{ id, {} };
+        for(int cpu: parse_cpu_list(list))
+            if(std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+                node.cpus.push_back(cpu);
+        if(!node.cpus.empty())
+            nodes.push_back(std::move(node));
+    }
+
+    std::sort(nodes.begin(), nodes.end(),
+              [](const NumaNode& a, const NumaNode& b){ return a.id < b.id; });
+
+    if(nodes.empty())
+        nodes.push_back({ 0, allowed });
+    return nodes;
+}
+
+#endif
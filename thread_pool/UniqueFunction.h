@@ -0,0 +1,118 @@
+#ifndef UNIQUE_FUNCTION_H
+#define UNIQUE_FUNCTION_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// a move-only std::function<void()>, callables that fit into the inline
+// storage and can be moved without throwing never touch the heap
+class UniqueFunction {
+public:
+    UniqueFunction() noexcept = default;
+
+    template<class F,
+             class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, UniqueFunction>>>
+    UniqueFunction(F&& f)
+    {
+        using callable = std::decay_t<F>;
+
+        if constexpr(fits_inline<callable>())
+        {
+            ::new(static_cast<void*>(storage)) callable(std::forward<F>(f));
+            table = &inline_table<callable>;
+        }
+        else
+        {
+            ::new(static_cast<void*>(storage)) callable*(new callable(std::forward<F>(f)));
+            table = &heap_table<callable>;
+        }
+    }
+
+    UniqueFunction(UniqueFunction&& other) noexcept
+        :   table(other.table)
+    {
+        if(table)
+        {
+            table->move(storage, other.storage);
+            other.table = nullptr;
+        }
+    }
+
+    UniqueFunction& operator=(UniqueFunction&& other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            if(other.table)
+            {
+                other.table->move(storage, other.storage);
+                table = other.table;
+                other.table = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    UniqueFunction(const UniqueFunction&) = delete;
+    UniqueFunction& operator=(const UniqueFunction&) = delete;
+
+    ~UniqueFunction() { reset(); }
+
+    explicit operator bool() const noexcept { return table != nullptr; }
+
+    void operator()() { table->call(storage); }
+
+private:
+    // sized so that a whole UniqueFunction is one cache line
+    static constexpr std::size_t inline_size = 64 - sizeof(void*);
+
+    struct vtable {
+        void (*call)(void*);
+        // move constructs into dst and destroys src
+        void (*move)(void* dst, void* src) noexcept;
+        void (*destroy)(void*) noexcept;
+    };
+
+    template<class F>
+    static constexpr bool fits_inline()
+    {
+        return sizeof(F) <= inline_size
+            && alignof(F) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<F>;
+    }
+
+    template<class F>
+    static constexpr vtable inline_table = {
+        [](void* p) { (*static_cast<F*>(p))(); },
+        [](void* dst, void* src) noexcept {
+            ::new(dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        },
+        [](void* p) noexcept { static_cast<F*>(p)->~F(); }
+    };
+
+    template<class F>
+    static constexpr vtable heap_table = {
+        [](void* p) { (**static_cast<F**>(p))(); },
+        [](void* dst, void* src) noexcept {
+            ::new(dst) F*(*static_cast<F**>(src));
+        },
+        [](void* p) noexcept { delete *static_cast<F**>(p); }
+    };
+
+    void reset() noexcept
+    {
+        if(table)
+        {
+            table->destroy(storage);
+            table = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    const vtable* table = nullptr;
+};
+
+#endif
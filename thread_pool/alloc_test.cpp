@@ -0,0 +1,126 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <latch>
+#include <new>
+#include <vector>
+
+#include "CountingAllocator.h"
+#include "MpmcQueue.h"
+#include "MpscQueue.h"
+#include "TaskGroup.h"
+#include "ThreadPool.h"
+
+// checks that once a pool is warmed up, submitting tasks doesn't touch the
+// global allocator with any of the shared lane queue policies: enqueue + get
+// round trips, windows of futures that are all pending at the same time, and
+// bursts of TaskGroup tasks that queue up before the workers drain them
+
+constexpr size_t threads = 4;
+constexpr size_t round_trips = 100000;
+// futures pending at once, below the idle states a BlockCache depot keeps.
+// larger windows hand their states back to the global allocator.
+constexpr size_t window = 1024;
+constexpr size_t windows = 100;
+// a worker holds on to up to two BlockCache batches of freed states before
+// it passes one on, so the warm-up creates enough states for a window while
+// every worker sits on its share
+constexpr size_t warm_up = window + threads * 64;
+// posted tasks carry no shared state, so a burst may queue up more of them
+// than the depot keeps
+constexpr size_t burst = 10000;
+constexpr size_t bursts = 10;
+
+template<class Pool>
+static void round_trip(Pool& pool, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+        if(pool.enqueue([i]{ return i; }).get() != i)
+            std::abort();
+}
+
+template<class Pool>
+static void windows_of(Pool& pool, std::vector< Future<size_t> >& pending, size_t size, size_t rounds)
+{
+    for(size_t round = 0; round < rounds; ++round)
+    {
+        for(size_t i = 0; i < size; ++i)
+            pending.push_back(pool.enqueue([i]{ return i; }));
+        for(size_t i = 0; i < size; ++i)
+            if(pending[i].get() != i)
+                std::abort();
+        pending.clear();
+    }
+}
+
+template<class Pool>
+static void bursts_of(Pool& pool, size_t rounds)
+{
+    std::atomic<size_t> ran{0};
+    for(size_t round = 0; round < rounds; ++round)
+    {
+        TaskGroup group(pool);
+        for(size_t i = 0; i < burst; ++i)
+            group.run([&ran]{ ran.fetch_add(1, std::memory_order_relaxed); });
+        group.wait();
+    }
+    if(ran != rounds * burst)
+        std::abort();
+}
+
+// queues a whole burst behind workers that are held up, so the lanes grow,
+// or create their nodes, to the deepest a burst can get once instead of
+// during the measurement
+template<class Pool>
+static void fill_lanes(Pool& pool)
+{
+    std::latch release(1);
+    TaskGroup group(pool);
+    for(size_t i = 0; i < threads; ++i)
+        group.run([&release]{ release.wait(); });
+    for(size_t i = 0; i < burst; ++i)
+        group.run([]{});
+    release.count_down();
+    group.wait();
+}
+
+template<class Run>
+static bool expect_no_allocations(const char* policy, const char* scenario, size_t operations, Run run)
+{
+    const unsigned long long before = allocations.load();
+    run();
+    const unsigned long long made = allocations.load() - before;
+
+    std::printf("%-8s %-10s %llu allocations in %zu operations\n", policy, scenario, made, operations);
+    return made == 0;
+}
+
+template<class Pool>
+static bool check(const char* policy)
+{
+    Pool pool(threads);
+    std::vector< Future<size_t> > pending;
+    pending.reserve(warm_up);
+
+    // fills the caches, the queues and the workers' thread locals
+    fill_lanes(pool);
+    windows_of(pool, pending, warm_up, 1);
+    bursts_of(pool, 1);
+    round_trip(pool, round_trips);
+
+    bool passed = expect_no_allocations(policy, "round_trip", round_trips,
+                                        [&]{ round_trip(pool, round_trips); });
+    passed &= expect_no_allocations(policy, "window", window * windows,
+                                    [&]{ windows_of(pool, pending, window, windows); });
+    passed &= expect_no_allocations(policy, "burst", burst * bursts,
+                                    [&]{ bursts_of(pool, bursts); });
+    return passed;
+}
+
+int main()
+{
+    bool passed = check<ThreadPool>("locked");
+    passed &= check< BasicThreadPool<MpmcQueue> >("mpmc");
+    passed &= check< BasicThreadPool<MpscQueue> >("mpsc");
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "CountingAllocator.h"
+#include "MpmcQueue.h"
+#include "MpscQueue.h"
+#include "TaskGroup.h"
+#include "ThreadPool.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static unsigned long long nanoseconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+}
+
+// busy work that the optimizer can't remove
+static void spin_for(std::chrono::nanoseconds duration)
+{
+    const auto until = bench_clock::now() + duration;
+    while(bench_clock::now() < until)
+        ;
+}
+
+struct Settings {
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t tasks = 200000;
+    size_t repeat = 3;
+    std::string scenario;
+    std::string config;
+};
+
+// the queue policy of the shared lanes
+enum class QueueKind { locked, mpmc, mpsc };
+
+struct Config {
+    std::string name;
+    ThreadPoolOptions options;
+    QueueKind queue = QueueKind::locked;
+};
+
+// the pool configurations compared in one run
+static std::vector<Config> configs(const Settings& settings)
+{
+    std::vector<Config> list;
+
+    ThreadPoolOptions fixed;
+    fixed.min_threads = fixed.max_threads = settings.threads;
+    list.push_back({ "fixed", fixed });
+
+    ThreadPoolOptions no_spin = fixed;
+    no_spin.spin = std::chrono::microseconds(0);
+    list.push_back({ "fixed_no_spin", no_spin });
+
+    ThreadPoolOptions adaptive;
+    adaptive.min_threads = 1;
+    adaptive.max_threads = settings.threads;
+    list.push_back({ "adaptive", adaptive });
+
+    list.push_back({ "fixed_mpmc", fixed, QueueKind::mpmc });
+    list.push_back({ "fixed_mpsc", fixed, QueueKind::mpsc });
+
+    return list;
+}
+
+// what one scenario run measured: the wall time for all operations and
+// one latency sample per operation
+struct Result {
+    size_t operations = 0;
+    unsigned long long elapsed_ns = 0;
+    unsigned long long allocations = 0;
+    std::vector<unsigned long long> latencies;
+};
+
+static unsigned long long percentile(std::vector<unsigned long long>& sorted, double p)
+{
+    if(sorted.empty())
+        return 0;
+    size_t index = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size() - 1));
+    return sorted[index];
+}
+
+static void report(const Settings& settings, const std::string& config,
+                   const std::string& scenario, Result& result)
+{
+    std::sort(result.latencies.begin(), result.latencies.end());
+    const double seconds = static_cast<double>(result.elapsed_ns) / 1e9;
+
+    std::cout << "{\"config\":\"" << config << "\""
+              << ",\"scenario\":\"" << scenario << "\""
+              << ",\"threads\":" << settings.threads
+              << ",\"operations\":" << result.operations
+              << ",\"seconds\":" << seconds
+              << ",\"ops_per_sec\":" << (seconds > 0 ? static_cast<double>(result.operations) / seconds : 0.0)
+              << ",\"p50_ns\":" << percentile(result.latencies, 50)
+              << ",\"p90_ns\":" << percentile(result.latencies, 90)
+              << ",\"p99_ns\":" << percentile(result.latencies, 99)
+              << ",\"p999_ns\":" << percentile(result.latencies, 99.9)
+              << ",\"allocs_per_op\":"
+              << (result.operations ? static_cast<double>(result.allocations) / static_cast<double>(result.operations) : 0.0)
+              << "}" << std::endl;
+}
+
+// empty tasks from one producer, latency is enqueue to completion
+template<class Pool>
+static Result empty_tasks(Pool& pool, const Settings& settings)
+{
+    Result result;
+    result.operations = settings.tasks;
+    result.latencies.resize(settings.tasks);
+
+    TaskGroup group(pool);
+    const auto start = bench_clock::now();
+    for(size_t i = 0; i < settings.tasks; ++i)
+        group.run([&latency = result.latencies[i], submitted = bench_clock::now()]
+        {
+            latency = nanoseconds_since(submitted);
+        });
+    group.wait();
+    result.elapsed_ns = nanoseconds_since(start);
+    return result;
+}
+
+// one task at a time on an otherwise idle pool, latency is enqueue to start
+template<class Pool>
+static Result enqueue_latency(Pool& pool, const Settings& settings)
+{
+    Result result;
+    result.operations = std::min<size_t>(settings.tasks, 20000);
+    result.latencies.resize(result.operations);
+
+    const auto start = bench_clock::now();
+    for(size_t i = 0; i < result.operations; ++i)
+    {
+        const auto submitted = bench_clock::now();
+        result.latencies[i] = pool.enqueue([submitted]{ return nanoseconds_since(submitted); }).get();
+    }
+    result.elapsed_ns = nanoseconds_since(start);
+    return result;
+}
+
+// rounds of a burst of small tasks joined before the next round starts,
+// latency is the time of one round
+template<class Pool>
+static Result fan_out_fan_in(Pool& pool, const Settings& settings)
+{
+    const size_t width = 64;
+    const size_t rounds = std::max<size_t>(1, settings.tasks / width);
+
+    Result result;
+    result.operations = rounds * width;
+    result.latencies.reserve(rounds);
+
+    std::vector<unsigned long long> partial(width);
+    const auto start = bench_clock::now();
+    for(size_t round = 0; round < rounds; ++round)
+    {
+        const auto round_start = bench_clock::now();
+        TaskGroup group(pool);
+        for(size_t i = 0; i < width; ++i)
+            group.run([&partial, i, round]{ partial[i] = i * round; });
+        group.wait();
+        result.latencies.push_back(nanoseconds_since(round_start));
+    }
+    result.elapsed_ns = nanoseconds_since(start);
+    return result;
+}
+
+// a binary tree of tasks, every inner node spawns its children from inside
+// the pool and waits for them, latency is per leaf from its spawn
+template<class Pool>
+static void spawn_tree(Pool& pool, size_t depth, std::atomic<size_t>& leaves,
+                       std::vector<unsigned long long>& latencies, bench_clock::time_point spawned)
+{
+    if(depth == 0)
+    {
+        latencies[leaves.fetch_add(1, std::memory_order_relaxed)] = nanoseconds_since(spawned);
+        return;
+    }
+
+    TaskGroup group(pool);
+    for(int child = 0; child < 2; ++child)
+        group.run([&pool, depth, &leaves, &latencies, now = bench_clock::now()]
+        {
+            spawn_tree(pool, depth - 1, leaves, latencies, now);
+        });
+    group.wait();
+}
+
+template<class Pool>
+static Result recursive_spawn(Pool& pool, const Settings& settings)
+{
+    size_t depth = 1;
+    while((size_t(2) << depth) <= settings.tasks)
+        ++depth;
+
+    Result result;
+    std::atomic<size_t> leaves{0};
+    result.latencies.resize(size_t(1) << depth);
+
+    const auto start = bench_clock::now();
+    pool.enqueue([&]{ spawn_tree(pool, depth, leaves, result.latencies, bench_clock::now()); }).get();
+    result.elapsed_ns = nanoseconds_since(start);
+    // inner nodes and leaves
+    result.operations = (size_t(2) << depth) - 1;
+    return result;
+}
+
+// mostly empty tasks with one in sixteen running for 20us, latency is
+// enqueue to completion
+template<class Pool>
+static Result mixed_sizes(Pool& pool, const Settings& settings)
+{
+    Result result;
+    result.operations = settings.tasks / 4;
+    result.latencies.resize(result.operations);
+
+    TaskGroup group(pool);
+    const auto start = bench_clock::now();
+    for(size_t i = 0; i < result.operations; ++i)
+        group.run([&latency = result.latencies[i], i, submitted = bench_clock::now()]
+        {
+            if(i % 16 == 0)
+                spin_for(std::chrono::microseconds(20));
+            latency = nanoseconds_since(submitted);
+        });
+    group.wait();
+    result.elapsed_ns = nanoseconds_since(start);
+    return result;
+}
+
+// the same number of empty tasks split over several producer threads
+template<class Pool>
+static Result producers(Pool& pool, const Settings& settings, size_t producer_count)
+{
+    Result result;
+    result.operations = settings.tasks;
+    result.latencies.resize(settings.tasks);
+
+    TaskGroup group(pool);
+    std::vector<std::thread> threads;
+    const size_t share = settings.tasks / producer_count;
+
+    const auto start = bench_clock::now();
+    for(size_t p = 0; p < producer_count; ++p)
+        threads.emplace_back([&, p]
+        {
+            const size_t first = p * share;
+            const size_t last = p + 1 == producer_count ? settings.tasks : first + share;
+            for(size_t i = first; i < last; ++i)
+                group.run([&latency = result.latencies[i], submitted = bench_clock::now()]
+                {
+                    latency = nanoseconds_since(submitted);
+                });
+        });
+    for(std::thread& thread: threads)
+        thread.join();
+    group.wait();
+    result.elapsed_ns = nanoseconds_since(start);
+    return result;
+}
+
+// runs one scenario settings.repeat times on a fresh pool and reports the
+// repetition with the best throughput
+template<class Pool>
+static void run(const Settings& settings, const Config& config, const std::string& scenario,
+                const std::function<Result(Pool&)>& body)
+{
+    if(!settings.scenario.empty() && scenario.compare(0, settings.scenario.size(), settings.scenario) != 0)
+        return;
+
+    Result best;
+    for(size_t r = 0; r < settings.repeat; ++r)
+    {
+        Pool pool(config.options);
+        // one untimed round so thread creation and cache warm up don't count
+        body(pool);
+
+        const auto allocations_before = allocations.load();
+        Result result = body(pool);
+        result.allocations = allocations.load() - allocations_before;
+
+        if(r == 0 || result.elapsed_ns * best.operations < best.elapsed_ns * result.operations)
+            best = std::move(result);
+    }
+    report(settings, config.name, scenario, best);
+}
+
+// every scenario against one configuration
+template<class Pool>
+static void run_all(const Settings& settings, const Config& config)
+{
+    run<Pool>(settings, config, "empty_tasks", [&](Pool& pool){ return empty_tasks(pool, settings); });
+    run<Pool>(settings, config, "enqueue_latency", [&](Pool& pool){ return enqueue_latency(pool, settings); });
+    run<Pool>(settings, config, "fan_out_fan_in", [&](Pool& pool){ return fan_out_fan_in(pool, settings); });
+    run<Pool>(settings, config, "recursive_spawn", [&](Pool& pool){ return recursive_spawn(pool, settings); });
+    run<Pool>(settings, config, "mixed_sizes", [&](Pool& pool){ return mixed_sizes(pool, settings); });
+
+    for(size_t count = 1; ; count *= 2)
+    {
+        count = std::min(count, settings.threads);
+        run<Pool>(settings, config, "producers_" + std::to_string(count),
+            [&](Pool& pool){ return producers(pool, settings, count); });
+        if(count == settings.threads)
+            break;
+    }
+}
+
+static void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [--threads N] [--tasks N] [--repeat N]"
+                                      " [--scenario PREFIX] [--config NAME]\n"
+                 "Prints one JSON object per configuration and scenario.\n";
+}
+
+int main(int argc, char* argv[])
+{
+    Settings settings;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if(i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        if(arg == "--threads")
+            settings.threads = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        else if(arg == "--tasks")
+            settings.tasks = std::max(64ul, std::strtoul(argv[++i], nullptr, 10));
+        else if(arg == "--repeat")
+            settings.repeat = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        else if(arg == "--scenario")
+            settings.scenario = argv[++i];
+        else if(arg == "--config")
+            settings.config = argv[++i];
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for(const Config& config: configs(settings))
+    {
+        if(!settings.config.empty() && settings.config != config.name)
+            continue;
+
+        switch(config.queue)
+        {
+        case QueueKind::locked:
+            run_all<ThreadPool>(settings, config);
+            break;
+        case QueueKind::mpmc:
+            run_all< BasicThreadPool<MpmcQueue> >(settings, config);
+            break;
+        case QueueKind::mpsc:
+            run_all< BasicThreadPool<MpscQueue> >(settings, config);
+            break;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -2,13 +2,29 @@
 #include <vector>
 #include <chrono>
 
+#include "Task.h"
 #include "ThreadPool.h"
 
+// hops onto a worker without blocking or creating a thread
+Task<int> square(ThreadPool& pool, int i)
+{
+    co_await pool.schedule();
+    co_return i*i;
+}
+
+Task<int> sum_of_squares(ThreadPool& pool, int n)
+{
+    int sum = 0;
+    for(int i = 0; i < n; ++i)
+        sum += co_await square(pool, i);
+    co_return sum;
+}
+
 int main()
 {
     
     ThreadPool pool(4);
-    std::vector< std::future<int> > results;
+    std::vector< Future<int> > results;
 
     for(int i = 0; i < 8; ++i) {
         results.emplace_back(
@@ -24,6 +40,8 @@ int main()
     for(auto && result: results)
         std::cout << result.get() << ' ';
     std::cout << std::endl;
+
+    std::cout << spawn(sum_of_squares(pool, 8)).get() << std::endl;
     
     return 0;
 }
@@ -0,0 +1,54 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+
+#include "ThreadPool.h"
+
+// checks that parallel_for and parallel_reduce cover their range exactly
+// once on a bounded pool with every reject policy. their helper tasks are
+// optional, a full pool must neither make the caller wait for room nor
+// throw, the caller runs the range itself.
+
+constexpr int count = 100000;
+
+static bool check(const char* name, RejectPolicy reject)
+{
+    ThreadPoolOptions options = ThreadPoolOptions::fixed(2);
+    options.capacity = 1;
+    options.reject = reject;
+    ThreadPool pool(options);
+
+    auto hits = std::make_unique< std::atomic<int>[] >(count);
+    pool.parallel_for(0, count, [&](int i){ hits[i].fetch_add(1, std::memory_order_relaxed); });
+
+    bool passed = true;
+    for(int i = 0; i < count; ++i)
+        passed &= hits[i].load() == 1;
+
+    const long long sum = pool.parallel_reduce(0, count, 0LL, [](int i){ return static_cast<long long>(i); },
+                                               std::plus<>{});
+    passed &= sum == static_cast<long long>(count) * (count - 1) / 2;
+
+    std::printf("%-12s %s\n", name, passed ? "passed" : "FAILED");
+    return passed;
+}
+
+int main()
+{
+    bool passed = true;
+    try
+    {
+        passed &= check("block", RejectPolicy::block);
+        passed &= check("drop", RejectPolicy::drop);
+        passed &= check("caller_runs", RejectPolicy::caller_runs);
+        passed &= check("throw_error", RejectPolicy::throw_error);
+    }
+    catch(const std::exception& error)
+    {
+        std::printf("threw: %s\n", error.what());
+        passed = false;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
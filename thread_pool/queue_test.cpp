@@ -0,0 +1,158 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "MpmcQueue.h"
+#include "MpscQueue.h"
+
+// pushes numbered items from several producers through the shared lane
+// queues and checks that every item comes out exactly once and that each
+// consumer sees a producer's items in the order they were pushed. the
+// bounded MpmcQueue is also checked for how it behaves when full or empty.
+
+constexpr std::size_t producers = 4;
+constexpr std::size_t consumers = 3;
+constexpr std::size_t items = 100000;
+// small enough that the producers keep finding the ring full
+constexpr std::size_t ring = 64;
+
+static bool fail(const char* queue, const char* what)
+{
+    std::printf("%-8s %s\n", queue, what);
+    return false;
+}
+
+static std::uint64_t item(std::size_t producer, std::size_t sequence)
+{
+    return std::uint64_t(producer) << 32 | sequence;
+}
+
+template<class Queue>
+static void produce(Queue& queue, std::size_t producer)
+{
+    for(std::size_t i = 0; i < items; ++i)
+    {
+        std::uint64_t value = item(producer, i);
+        while(!queue.try_push(value))
+            std::this_thread::yield();
+    }
+}
+
+// pops until all items have been taken, counting each one it gets
+template<class Queue>
+static bool consume(Queue& queue, std::atomic<std::size_t>& taken,
+                    std::vector< std::atomic<unsigned char> >& seen)
+{
+    std::vector<std::size_t> next(producers, 0);
+    bool ordered = true;
+    std::uint64_t value;
+    while(taken.load(std::memory_order_relaxed) < producers * items)
+    {
+        if(!queue.try_pop(value))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        taken.fetch_add(1, std::memory_order_relaxed);
+
+        const std::size_t producer = value >> 32;
+        const std::size_t sequence = value & 0xffffffff;
+        if(producer >= producers || sequence >= items)
+            return false;
+        ordered &= sequence >= next[producer];
+        next[producer] = sequence + 1;
+        seen[producer * items + sequence].fetch_add(1, std::memory_order_relaxed);
+    }
+    return ordered;
+}
+
+template<class Queue>
+static bool stress(const char* name, Queue& queue, std::size_t consumer_count)
+{
+    std::vector< std::atomic<unsigned char> > seen(producers * items);
+    std::atomic<std::size_t> taken{0};
+    std::atomic<bool> ordered{true};
+
+    std::vector<std::thread> threads;
+    for(std::size_t c = 0; c < consumer_count; ++c)
+        threads.emplace_back([&]{
+            if(!consume(queue, taken, seen))
+                ordered = false;
+        });
+    for(std::size_t p = 0; p < producers; ++p)
+        threads.emplace_back([&queue, p]{ produce(queue, p); });
+    for(auto& thread: threads)
+        thread.join();
+
+    bool passed = true;
+    if(!ordered)
+        passed = fail(name, "popped a producer's items out of order");
+    for(auto& count: seen)
+        if(count.load() != 1)
+        {
+            passed = fail(name, "popped an item other than exactly once");
+            break;
+        }
+    std::uint64_t value;
+    if(queue.try_pop(value))
+        passed = fail(name, "has items left after all were popped");
+    std::printf("%-8s %zu items from %zu producers to %zu consumers %s\n",
+                name, producers * items, producers, consumer_count, passed ? "ok" : "failed");
+    return passed;
+}
+
+// fills and drains the ring a few times around, so the slots' sequence
+// numbers wrap past their first lap
+static bool full_and_empty()
+{
+    MpmcQueue<std::uint64_t> queue(5);
+    if(queue.capacity() != 8)
+        return fail("mpmc", "doesn't round its capacity up to a power of two");
+
+    std::uint64_t value = 0;
+    if(queue.try_pop(value))
+        return fail("mpmc", "popped from an empty queue");
+
+    for(std::uint64_t lap = 0; lap < 4; ++lap)
+    {
+        for(std::uint64_t i = 0; i < queue.capacity(); ++i)
+        {
+            value = lap * 100 + i;
+            if(!queue.try_push(value))
+                return fail("mpmc", "refused a push below its capacity");
+        }
+        value = 42;
+        if(queue.try_push(value))
+            return fail("mpmc", "took a push beyond its capacity");
+        if(value != 42)
+            return fail("mpmc", "moved from an item it refused");
+
+        for(std::uint64_t i = 0; i < queue.capacity(); ++i)
+            if(!queue.try_pop(value) || value != lap * 100 + i)
+                return fail("mpmc", "didn't pop its items in order");
+        if(queue.try_pop(value))
+            return fail("mpmc", "popped from a drained queue");
+    }
+    std::printf("%-8s full and empty ok\n", "mpmc");
+    return true;
+}
+
+int main()
+{
+    bool passed = full_and_empty();
+    {
+        MpmcQueue<std::uint64_t> queue(ring);
+        passed &= stress("mpmc", queue, consumers);
+    }
+    {
+        // twice through the same queue, the second round runs on the nodes
+        // the first one left on the free stack
+        MpscQueue<std::uint64_t> queue(0);
+        passed &= stress("mpsc", queue, 1);
+        passed &= stress("mpsc", queue, 1);
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
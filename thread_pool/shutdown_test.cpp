@@ -0,0 +1,43 @@
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "ThreadPool.h"
+
+// destroys pools while their tasks keep posting more tasks. a worker that
+// got past the stop check in push_tasks goes on to start another worker,
+// which must not wait for the destructor joining the workers.
+
+constexpr size_t iterations = 20000;
+// more chains than workers, so a post finds the backlog larger than the
+// pool and tries to grow it
+constexpr size_t chains = 3;
+
+// posts itself again until the pool refuses
+struct Repost {
+    ThreadPool* pool;
+
+    void operator()() const
+    {
+        try
+        {
+            pool->post(*this);
+        }
+        catch(const std::runtime_error&)
+        {
+        }
+    }
+};
+
+int main()
+{
+    for(size_t i = 0; i < iterations; ++i)
+    {
+        ThreadPool pool(2);
+        for(size_t chain = 0; chain < chains; ++chain)
+            pool.post(Repost{ &pool });
+    }
+
+    std::printf("destroyed %zu pools with tasks still posting\n", iterations);
+    return EXIT_SUCCESS;
+}